@@ -6,6 +6,14 @@ enum LedType {
   SK6812,
 };
 
+enum RealtimeSource {
+  REALTIME_NONE,
+  REALTIME_WEBSOCKET,
+  REALTIME_DDP,
+  REALTIME_E131,
+  REALTIME_ARTNET,
+};
+
 /*
  * Includes
  */
@@ -16,7 +24,10 @@ enum LedType {
 #include <AsyncTimer.h>
 #include <EEvar.h>
 #include <ESPAsyncWebServer.h>
+#include <LittleFS.h>
 #include <LuaWrapper.h>
+#include <WiFiUdp.h>
+#include <libb64/cdecode.h>
 #ifdef ESP32
 #include <AsyncTCP.h>
 #include <WiFi.h>
@@ -45,7 +56,21 @@ enum LedType {
 // Default Config
 #define DEFAULT_LED_COUNT 60
 #define DEFAULT_LED_BRIGHTNESS 50
+#define DEFAULT_LED_FPS 60
+#define MAX_LED_SEGMENTS 8
+#define MAX_LED_OUTPUTS 4
+#define MAX_BATCH_REQUESTS 16
+#define MAX_WS_MESSAGE_SIZE 4096
+#define MAX_WS_PENDING_REQUESTS 8
+#define MAX_HTTP_PENDING_REQUESTS 4
+#define WS_REALTIME_HEADER_SIZE 6
+#define DEFAULT_LUA_MEMORY_LIMIT (16 * 1024)
+#define DEFAULT_LUA_TIME_BUDGET 10000
+#define SCRIPT_HASH_LENGTH 24  // Hex digits of a script's 64-bit digest and 32-bit length
 #define DEFAULT_LED_TYPE LedType::SK6812
+#define DEFAULT_REALTIME_TIMEOUT 2500
+#define DEFAULT_REALTIME_PRIORITY 100
+#define DEFAULT_UDP_UNIVERSE 1
 #ifdef ESP32
 #define DEFAULT_LED_PIN 16
 #elif ESP8266
@@ -70,6 +95,27 @@ struct ColorRGBW {
   uint8_t w = 0;
 };
 
+struct OutputConfig {
+  uint8_t pin = DEFAULT_LED_PIN;
+  LedType type = DEFAULT_LED_TYPE;
+  uint16_t count = 0;
+  uint16_t offset = 0;  // First pixel of the logical buffer shown on this output
+};
+
+struct LuaOptions {
+  int segment = 0;
+  uint32_t memory_limit = DEFAULT_LUA_MEMORY_LIMIT;
+  uint32_t time_budget_us = DEFAULT_LUA_TIME_BUDGET;
+  uint32_t instruction_budget = 0;  // 0 for no instruction limit
+  bool abort_on_overrun = false;    // Stop the script instead of throttling it
+};
+
+struct SegmentConfig {
+  uint16_t start = 0;
+  uint16_t length = 0;
+  bool reverse = false;
+};
+
 ColorRGBW color_rgbw_black = ColorRGBW({
     .r = 0,
     .g = 0,
@@ -111,10 +157,17 @@ namespace ota {
 
 namespace led {
   void stop_lua();
+  size_t get_arena_size();
+  int get_count();
+  int get_max_count();
+  bool write_realtime(RealtimeSource source, uint8_t priority, uint16_t sequence, int offset, const uint8_t *data, int count, int bytes_per_pixel);
 }
 
 JsonDocument get_full_state();
 JsonDocument handle_request(int req_id, String method, JsonVariant params);
+JsonDocument handle_batch(JsonArray requests);
+JsonDocument handle_message(JsonVariant req);
+bool is_async_safe(JsonVariant req);
 void emit_event(String event, JsonDocument &data);
 void emit_event(String event);
 
@@ -135,6 +188,16 @@ struct Config {
   char wifi_ssid[32];
   char wifi_pass[64];
   char name[32];
+  int led_fps = DEFAULT_LED_FPS;
+  int led_palette_size = 0;
+  int led_segment_count = 0;  // 0 for a single segment covering the whole strip
+  SegmentConfig led_segments[MAX_LED_SEGMENTS];
+  int led_output_count = 0;  // 0 for a single output on led_pin with led_count LEDs of led_type
+  OutputConfig led_outputs[MAX_LED_OUTPUTS];
+  char lua_autostart[SCRIPT_HASH_LENGTH + 1] = "";  // Hash of the cached script started at boot, empty for none
+  LuaOptions lua_autostart_options;
+  uint16_t realtime_timeout = DEFAULT_REALTIME_TIMEOUT;  // Milliseconds without pixels before a stream ends
+  uint16_t udp_universe = DEFAULT_UDP_UNIVERSE;          // E1.31 and Art-Net universe of the first pixel
 };
 EEvar<Config> config((Config()));
 
@@ -261,6 +324,8 @@ namespace sys {
     result["platform"] = PLATFORM;
     result["uptime"] = millis() / 1000;
     result["heap_free"] = ESP.getFreeHeap();
+    result["led_arena_size"] = led::get_arena_size();
+    result["led_count_max"] = led::get_max_count();
     result["flash_size"] = ESP.getFlashChipSize();
     result["flash_speed"] = ESP.getFlashChipSpeed();
     result["flash_mode"] = ESP.getFlashChipMode();
@@ -288,6 +353,11 @@ namespace sys {
     debug("Name: " + String(config->name));
     debug("Version: " + String(VERSION));
 
+    // Mount the filesystem, which holds the script cache
+    if (!LittleFS.begin()) {
+      debug("Could not mount LittleFS");
+    }
+
     timer.setInterval([]() { debug("Uptime: " + String(millis() / 1000) + "s"); }, 1000 * 10);
   }
 
@@ -425,6 +495,14 @@ namespace serial {
           return;
         }
 
+        // Handle a batch of requests
+        if (req.is<JsonArray>()) {
+          JsonDocument res = handle_batch(req.as<JsonArray>());
+          serializeJson(res, Serial);
+          Serial.println();
+          return;
+        }
+
         if (!req["id"].is<int>()) {
           debug("Received a message, but it doesn't contain an ID");
           return;
@@ -718,10 +796,196 @@ namespace http {
   // AsyncWebServer *webserver = NULL;
   // AsyncWebSocket *websocket = NULL;
 
+  // Messages split over several frames or chunks, per client
+  struct WebSocketBuffer {
+    uint32_t client_id;
+    std::vector<uint8_t> data;
+    bool overflow = false;
+  };
+  std::vector<WebSocketBuffer> ws_buffers;
+
+  // Requests that can't run in the network callback, handled in the loop
+  struct WebSocketRequest {
+    uint32_t client_id;
+    JsonDocument req;
+  };
+  std::vector<WebSocketRequest> ws_pending;
+
+  // Same for HTTP. The request is NULL once the client has disconnected.
+  struct HTTPRequest {
+    AsyncWebServerRequest *request;
+    JsonDocument req;
+  };
+  std::vector<HTTPRequest> http_pending;
+
   void debug(String message) {
     ::debug("http", message);
   }
 
+  WebSocketBuffer &get_ws_buffer(uint32_t client_id) {
+    for (WebSocketBuffer &buffer : ws_buffers) {
+      if (buffer.client_id == client_id) {
+        return buffer;
+      }
+    }
+
+    ws_buffers.push_back(WebSocketBuffer{
+        .client_id = client_id,
+    });
+    return ws_buffers.back();
+  }
+
+  void delete_ws_buffer(uint32_t client_id) {
+    for (auto it = ws_buffers.begin(); it != ws_buffers.end(); it++) {
+      if (it->client_id == client_id) {
+        ws_buffers.erase(it);
+        return;
+      }
+    }
+  }
+
+  void send_json(AsyncWebServerRequest *request, JsonDocument &doc) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+  }
+
+  void forget_http_request(AsyncWebServerRequest *request) {
+    for (HTTPRequest &pending : http_pending) {
+      if (pending.request == request) {
+        pending.request = NULL;
+      }
+    }
+  }
+
+  bool has_ws_pending(uint32_t client_id) {
+    for (const WebSocketRequest &pending : ws_pending) {
+      if (pending.client_id == client_id) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void send_ws(AsyncWebSocketClient *client, JsonDocument &doc) {
+    // Serialize
+    String output;
+    serializeJson(doc, output);
+
+    client->text(output);
+  }
+
+  void send_ws_error(AsyncWebSocketClient *client, JsonVariant id, const char *err) {
+    JsonDocument res;
+    res["error"] = err;
+    if (!id.isNull()) {
+      res["id"] = id;
+    }
+
+    send_ws(client, res);
+  }
+
+  void handle_ws_message(AsyncWebSocketClient *client, const uint8_t *data, size_t len) {
+    JsonDocument req;
+    DeserializationError error = deserializeJson(req, data, len);
+    if (error) {
+      debug("Received a WebSocket message, but couldn't be parsed as JSON: " + String(error.f_str()));
+      send_ws_error(client, JsonVariant(), "invalid_json");
+      return;
+    }
+
+    // Quick reads are answered right away, everything else waits for the loop.
+    // Replies keep the order of the requests, so a read waits behind the client's queued requests.
+    if (is_async_safe(req.as<JsonVariant>()) && !has_ws_pending(client->id())) {
+      JsonDocument res = handle_message(req.as<JsonVariant>());
+      send_ws(client, res);
+      return;
+    }
+
+    if (ws_pending.size() >= MAX_WS_PENDING_REQUESTS) {
+      send_ws_error(client, req["id"], "busy");
+      return;
+    }
+
+    ws_pending.push_back(WebSocketRequest{
+        .client_id = client->id(),
+        .req = std::move(req),
+    });
+  }
+
+  // Binary messages carry realtime pixels, shown on the next frame without going through JSON:
+  //   0     Bytes per pixel, 3 for RGB or 4 for RGBW
+  //   1     Reserved, 0
+  //   2-3   Frame sequence number, little-endian. 0 disables the check for late frames.
+  //   4-5   Offset of the first pixel, little-endian
+  //   6-    Pixel data
+  void handle_ws_realtime(const uint8_t *data, size_t len) {
+    uint8_t bytes_per_pixel = len >= WS_REALTIME_HEADER_SIZE
+        ? data[0]
+        : 0;
+    if (bytes_per_pixel != 3 && bytes_per_pixel != 4) {
+      debug("Received a WebSocket message, but it isn't a valid realtime frame");
+      return;
+    }
+
+    uint16_t sequence = data[2] | data[3] << 8;
+    uint16_t offset = data[4] | data[5] << 8;
+    int count = (len - WS_REALTIME_HEADER_SIZE) / bytes_per_pixel;
+    led::write_realtime(REALTIME_WEBSOCKET, DEFAULT_REALTIME_PRIORITY, sequence, offset, data + WS_REALTIME_HEADER_SIZE, count, bytes_per_pixel);
+  }
+
+  void handle_ws_data(AsyncWebSocketClient *client, AwsFrameInfo *info, uint8_t *data, size_t len) {
+    bool binary = info->message_opcode == WS_BINARY;
+    if (info->message_opcode != WS_TEXT && !binary) {
+      debug("Received a WebSocket message, but it isn't text or binary");
+      return;
+    }
+
+    // Most messages arrive whole, in a single frame
+    if (info->num == 0 && info->final && info->index == 0 && len == info->len) {
+      if (binary) {
+        handle_ws_realtime(data, len);
+      } else {
+        handle_ws_message(client, data, len);
+      }
+      return;
+    }
+
+    // Start of a fragmented message
+    WebSocketBuffer &buffer = get_ws_buffer(client->id());
+    if (info->num == 0 && info->index == 0) {
+      buffer.data.clear();
+      buffer.overflow = false;
+    }
+
+    // Drop the rest of a message that doesn't fit, but keep track of where it ends.
+    // A realtime frame can hold every pixel as RGBW.
+    size_t max_size = binary
+        ? WS_REALTIME_HEADER_SIZE + led::get_count() * 4
+        : MAX_WS_MESSAGE_SIZE;
+    if (buffer.overflow || buffer.data.size() + len > max_size) {
+      buffer.overflow = true;
+      buffer.data.clear();
+    } else {
+      buffer.data.insert(buffer.data.end(), data, data + len);
+    }
+
+    // Wait for the last chunk of the last frame
+    if (!info->final || info->index + len != info->len) {
+      return;
+    }
+
+    if (buffer.overflow) {
+      send_ws_error(client, JsonVariant(), "message_too_large");
+    } else if (binary) {
+      handle_ws_realtime(buffer.data.data(), buffer.data.size());
+    } else {
+      handle_ws_message(client, buffer.data.data(), buffer.data.size());
+    }
+    delete_ws_buffer(client->id());
+  }
+
   void setup() {
     // Websocket
     websocket = new AsyncWebSocket("/ws");
@@ -748,11 +1012,11 @@ namespace http {
         }
         case WS_EVT_DISCONNECT: {
           Serial.printf("WebSocket client #%u disconnected\n", client->id());
+          delete_ws_buffer(client->id());
           break;
         }
         case WS_EVT_DATA: {
-          // Parse data as JSON
-          // TODO
+          handle_ws_data(client, (AwsFrameInfo *)arg, data, len);
           break;
         }
         case WS_EVT_PONG:
@@ -776,25 +1040,33 @@ namespace http {
     webserver->addHandler(new AsyncCallbackJsonWebHandler("/", [](AsyncWebServerRequest *request, JsonVariant &req) {
       debug("POST " + request->url());
 
-      int req_id = 0;
-      if (!req["id"].is<int>()) {
-        req_id = req["id"].as<int>();
+      if (!req.is<JsonArray>() && !req["method"].is<String>()) {
+        request->send(400, "application/json", "{\"error\": \"invalid_method\"}");
+        return;
       }
 
-      if (!req["method"].is<String>()) {
-        request->send(400, "application/json", "{\"error\": \"invalid_method\"}");
+      // Quick reads are answered right away, everything else waits for the loop
+      if (is_async_safe(req)) {
+        JsonDocument res = handle_message(req);
+        send_json(request, res);
         return;
       }
 
-      // Handle the request
-      JsonDocument res = handle_request(
-          req_id,
-          req["method"].as<String>(),
-          req["params"].as<JsonVariant>());
+      if (http_pending.size() >= MAX_HTTP_PENDING_REQUESTS) {
+        request->send(503, "application/json", "{\"error\": \"busy\"}");
+        return;
+      }
 
-      AsyncResponseStream *response = request->beginResponseStream("application/json");
-      serializeJson(res, *response);
-      request->send(response);
+      // The parsed body is freed once this callback returns, keep a copy
+      JsonDocument copy;
+      copy.set(req);
+      http_pending.push_back(HTTPRequest{
+          .request = request,
+          .req = std::move(copy),
+      });
+      request->onDisconnect([request]() {
+        forget_http_request(request);
+      });
     }));
     webserver->onNotFound([](AsyncWebServerRequest *request) {
       debug("GET " + request->url() + " — Not Found");
@@ -807,6 +1079,33 @@ namespace http {
 
   void loop() {
     websocket->cleanupClients();
+
+    // Handle the deferred HTTP requests. They stay queued while they run, so a client
+    // disconnecting during a method that yields is still noticed.
+    size_t count = http_pending.size();
+    for (size_t i = 0; i < count; i++) {
+      JsonDocument req = std::move(http_pending.front().req);
+      JsonDocument res = handle_message(req.as<JsonVariant>());
+      if (http_pending.front().request != NULL) {
+        send_json(http_pending.front().request, res);
+      }
+      http_pending.erase(http_pending.begin());
+    }
+
+    // Handle the deferred WebSocket requests. Like above they stay queued while they run,
+    // so requests arriving meanwhile from the same client queue up behind them.
+    count = ws_pending.size();
+    for (size_t i = 0; i < count; i++) {
+      JsonDocument req = std::move(ws_pending.front().req);
+      JsonDocument res = handle_message(req.as<JsonVariant>());
+
+      // The client may have disconnected in the meantime
+      AsyncWebSocketClient *client = websocket->client(ws_pending.front().client_id);
+      if (client != NULL) {
+        send_ws(client, res);
+      }
+      ws_pending.erase(ws_pending.begin());
+    }
   }
 
   void emit(JsonDocument &doc) {
@@ -825,13 +1124,101 @@ namespace http {
 namespace led {
 
   const int ANIMATE_SPEED = 350;  // Milliseconds
-  const int MAX_LED_COUNT = 512;  // TODO: Make dynamic size
+  const int MAX_FPS = 120;
+  const int HEAP_RESERVE = 16 * 1024;  // Bytes left free for Wi-Fi, HTTP and Lua
+  const int PIXEL_BUFFERS = 4;         // previous, current, target & colors
+  const int FRAME_BUFFERS = 1;         // Composed frame, not used in palette mode
+
+  // Output correction, applied when pixels are written to the strip
+  constexpr double GAMMA = 2.2;
+  constexpr uint8_t WHITE_BALANCE_R = 255;
+  constexpr uint8_t WHITE_BALANCE_G = 255;
+  constexpr uint8_t WHITE_BALANCE_B = 255;
+  constexpr uint8_t WHITE_BALANCE_W = 255;
+
+  // A physical strip, showing `count` pixels of the logical buffer starting at `offset`
+  struct Output {
+    Adafruit_NeoPixel *strip;
+    uint16_t offset;
+    uint16_t count;
+    uint8_t bytes_per_pixel;
+
+    // Hash of the strip buffer that was last shown
+    uint32_t shown_hash;
+    bool shown_hash_valid;
+  };
+
+  std::vector<Output> outputs;
 
-  Adafruit_NeoPixel *strip = NULL;
-
-  unsigned long lua_timer;
   bool lua_running = false;
+  bool lua_show_requested = false;
+  bool lua_stop_requested = false;
   lua_State *lua_state;
+  int lua_segment = 0;  // Index of the segment the script draws into
+  int lua_render_ref = LUA_NOREF;  // Function called every frame, `render` or the whole chunk
+  unsigned long lua_start_ms = 0;
+  unsigned long lua_previous_ms = 0;
+
+  // Scripts with a `main` function run it as a coroutine, resumed once per frame until it waits
+  lua_State *lua_thread = NULL;
+  int lua_wait_frames = 0;  // Frames left to skip before resuming
+  unsigned long lua_wake_ms = 0;
+
+  struct LuaStats {
+    uint32_t calls = 0;
+    uint32_t errors = 0;
+    uint32_t overruns = 0;  // Calls interrupted for exceeding the frame budget
+    uint32_t throttled = 0;  // Frames skipped after an overrun
+    uint32_t gc_steps = 0;
+    uint32_t gc_cycles = 0;
+    uint32_t gc_time_us = 0;  // Time spent collecting after the last frame
+    uint32_t gc_time_max_us = 0;
+    uint32_t time_us = 0;  // Time spent in the last call
+    uint32_t time_max_us = 0;
+    uint64_t time_total_us = 0;
+  };
+  LuaStats lua_stats;
+
+  // Scripts allocate from the heap through lua_alloc, within a budget
+  const size_t LUA_MEMORY_MIN = 8 * 1024;
+
+  struct LuaMemory {
+    size_t limit = DEFAULT_LUA_MEMORY_LIMIT;
+    size_t used = 0;
+    size_t peak = 0;
+    uint32_t allocations = 0;
+    uint32_t failures = 0;  // Allocations refused because of the limit or a low heap
+  };
+  LuaMemory lua_memory;
+
+  // Every call gets a time and an optional instruction budget. They are checked
+  // by a count hook, every LUA_HOOK_INSTRUCTIONS VM instructions.
+  const int LUA_HOOK_INSTRUCTIONS = 1000;
+  LuaOptions lua_options;
+
+  // The collector is stopped, and stepped by the frame scheduler in the slack time
+  // after a frame. A cycle starts once the script's memory has doubled since the
+  // last one, or when it comes close to its limit.
+  const uint32_t LUA_GC_MIN_SLACK = 1000;  // Microseconds left before the next frame to start a step
+  const size_t LUA_GC_MIN_THRESHOLD = 4 * 1024;
+  bool lua_gc_collecting = false;
+  size_t lua_gc_threshold = LUA_GC_MIN_THRESHOLD;
+
+  // Memory still in use after the last cycle. Near the limit, the next cycle waits until another
+  // eighth of the limit has been allocated, so live data alone doesn't restart it every frame.
+  size_t lua_gc_live = 0;
+
+  // Scripts are cached in LittleFS by the hash of their uploaded content.
+  // Source scripts are replaced by their bytecode after the first compile.
+  const char *SCRIPTS_DIR = "/scripts";
+  const char *SCRIPT_TEMP_PATH = "/script.tmp";
+
+  unsigned long lua_call_start_us = 0;
+  uint32_t lua_call_instructions = 0;
+  bool lua_call_overrun = false;
+  bool lua_call_aborted = false;  // Interrupted, and failing until the call has unwound
+  int lua_throttle_frames = 0;  // Frames to skip after consecutive overruns, doubling up to 32
+  int lua_skip_frames = 0;
 
   JsonDocument get_config();
   void setup();
@@ -839,690 +1226,3748 @@ namespace led {
   JsonDocument get_state();
   void emit_state();
   int get_count();
+  int get_buffer_length();
   void set_count(int count);
-  void set_color(ColorRGBW color);
+  int get_fps();
+  uint32_t hash_strip(const uint8_t *bytes, size_t length);
 
   void debug(String message) {
     ::debug("led", message);
   }
 
-  ColorRGBW pixels_previous[MAX_LED_COUNT];
-  ColorRGBW pixels_current[MAX_LED_COUNT];
-  ColorRGBW pixels_target[MAX_LED_COUNT];
-  ColorRGBW colors_target[MAX_LED_COUNT];
+  // All pixel buffers live in a single heap allocation sized to the LED count
+  ColorRGBW *pixel_arena = NULL;
+  size_t pixel_arena_size = 0;
+
+  // In palette mode the four buffers above hold palette entries instead of pixels,
+  // and every pixel is an index into them. Transitions and brightness then cost
+  // O(palette), and the palette is only expanded when it's written to the strip.
+  ColorRGBW *pixels_previous = NULL;
+  ColorRGBW *pixels_current = NULL;
+  ColorRGBW *pixels_target = NULL;
+  ColorRGBW *colors_target = NULL;
+  uint8_t *pixel_indices = NULL;
+
+  // The composed frame. Producers (transitions, effects, Lua and realtime streams) write into it
+  // from the loop, and once per frame its changed range is written to the outputs. The strips
+  // keep their own buffers, so they never show a partial frame.
+  ColorRGBW *frame_pixels = NULL;
+  int frame_dirty_start = 0;  // Range of the frame changed since it was last presented
+  int frame_dirty_end = 0;
+
+  int palette_size = 0;  // 0 when every pixel has its own color
+  int palette_speed = 0;  // Rotation in palette entries per second
+  unsigned long palette_start_ms = 0;
+  uint8_t palette_offset = 0;
 
-  bool animating = false;
-  int animating_start_ms = 0;
-  int animating_delta_current = 0;
-  int animating_delta_previous = 0;
   ColorRGBW initial_color;
+  bool white_channel = true;  // Every output has a white channel
+
+  struct EffectParams {
+    uint8_t speed = 128;
+    uint8_t density = 128;
+    ColorRGBW color;
+  };
+
+  struct Segment;
+
+  struct Effect {
+    const char *name;
+    void (*render)(Segment &segment, uint64_t t);  // Renders into colors_target, t is in milliseconds
+  };
+
+  // A range of the strip with its own state. All segments are composited into
+  // the shared pixel buffers in one pass per frame.
+  struct Segment {
+    uint16_t start = 0;
+    uint16_t length = 0;
+    bool reverse = false;
+
+    bool state_on = true;
+    int state_brightness = DEFAULT_LED_BRIGHTNESS;
+    std::vector<ColorRGBW> state_colors;
+
+    // Channel value scaled by state_brightness, rebuilt when the brightness changes
+    uint8_t brightness_table[256];
+
+    bool animating = false;
+    int animating_start_ms = 0;
+    int animating_delta_current = 0;
+    int animating_delta_previous = 0;
+
+    const Effect *effect = NULL;
+    EffectParams effect_params;
+    uint64_t effect_ms = 0;  // Time the effect has run, 64-bit so t * speed doesn't wrap
+    unsigned long effect_last_ms = 0;
+    uint32_t effect_frame = 0;
+    std::vector<uint8_t> effect_state;  // Per-pixel state, for effects that need it
+
+    bool animate_pending = false;  // animate() deferred until the batch ends
+  };
+
+  std::vector<Segment> segments;
+
+  // Requests in a batch defer animate() until the batch ends, and share a single state event
+  int batch_depth = 0;
+  bool emit_state_pending = false;
+
+  // Frame scheduler
+  unsigned long frame_interval_us = 1000000 / DEFAULT_LED_FPS;
+  unsigned long frame_next_us = 0;
+
+  struct FrameStats {
+    uint32_t frames = 0;
+    uint32_t overruns = 0;  // Frames that took longer than the frame interval
+    uint32_t dropped = 0;   // Frames skipped because the loop was late
+    uint32_t shows = 0;
+    uint32_t shows_skipped = 0;  // Frames identical to the ones already on the outputs
+    uint32_t frame_time_us = 0;
+    uint32_t frame_time_max_us = 0;
+    uint64_t frame_time_total_us = 0;
+  };
+  FrameStats frame_stats;
+
+  // Realtime mode. Pixels streamed from the network are written straight into the frame,
+  // and replace the rendered one until the stream stops for the realtime timeout.
+  const uint16_t MIN_REALTIME_TIMEOUT = 100;
+  const uint16_t MAX_REALTIME_TIMEOUT = 60000;
+  RealtimeSource realtime_source = REALTIME_NONE;
+  uint8_t realtime_priority = 0;
+  uint16_t realtime_sequence = 0;
+  unsigned long realtime_last_ms = 0;
+
+  struct RealtimeStats {
+    uint32_t packets = 0;
+    uint32_t dropped = 0;  // Packets out of order, out of range, or from a second source
+    uint32_t frames = 0;
+    uint32_t timeouts = 0;
+  };
+  RealtimeStats realtime_stats;
+
+  const char *get_realtime_source_name(RealtimeSource source) {
+    switch (source) {
+      case REALTIME_WEBSOCKET:
+        return "websocket";
+      case REALTIME_DDP:
+        return "ddp";
+      case REALTIME_E131:
+        return "e131";
+      case REALTIME_ARTNET:
+        return "artnet";
+      default:
+        return NULL;
+    }
+  }
 
-  bool state_on = true;
-  int state_brightness = DEFAULT_LED_BRIGHTNESS;
-  std::vector<ColorRGBW> state_colors;
-
-  void set_target_pixel(int i, ColorRGBW &color) {
-    // Set color
-    pixels_target[i] = color;
-
-    // Mix color with brightness
-    pixels_target[i].r = (double)pixels_target[i].r * (double)state_brightness / (double)255;
-    pixels_target[i].g = (double)pixels_target[i].g * (double)state_brightness / (double)255;
-    pixels_target[i].b = (double)pixels_target[i].b * (double)state_brightness / (double)255;
-    pixels_target[i].w = (double)pixels_target[i].w * (double)state_brightness / (double)255;
+  // Blend two colors by `delta` (0 = from, 255 = to) in integer math.
+  // Two channels are packed per 32-bit word as 16-bit lanes, so each pixel
+  // costs two multiply-adds per word instead of eight soft-float operations.
+  inline ColorRGBW blend_pixel(const ColorRGBW &from, const ColorRGBW &to, uint8_t delta) {
+    uint32_t inverse = 255 - delta;
+
+    // Each lane holds from * (255 - delta) + to * delta, which is at most 255 * 255
+    uint32_t rb = ((uint32_t)from.r << 16 | from.b) * inverse + ((uint32_t)to.r << 16 | to.b) * delta;
+    uint32_t gw = ((uint32_t)from.g << 16 | from.w) * inverse + ((uint32_t)to.g << 16 | to.w) * delta;
+
+    // Divide every lane by 255: (x + 1 + (x >> 8)) >> 8 is exact for x <= 255 * 255
+    rb = ((rb + 0x00010001 + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    gw = ((gw + 0x00010001 + ((gw >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+
+    return ColorRGBW{
+        .r = (uint8_t)(rb >> 16),
+        .g = (uint8_t)(gw >> 16),
+        .b = (uint8_t)rb,
+        .w = (uint8_t)gw,
+    };
   }
 
-  void animate() {
-    // Set current pixels to previous pixels
-    for (int i = 0; i < config->led_count; i++) {
-      pixels_previous[i] = pixels_current[i];
+  // exp() and log() for generating lookup tables at compile time
+  constexpr double const_exp(double x) {
+    // exp(x) = exp(x / 256) ^ 256, with a Taylor series for the small argument
+    double reduced = x / 256;
+    double sum = 1;
+    double term = 1;
+    for (int n = 1; n < 12; n++) {
+      term *= reduced / n;
+      sum += term;
+    }
+    for (int i = 0; i < 8; i++) {
+      sum *= sum;
     }
+    return sum;
+  }
 
-    // Set target pixels to state pixels
-    for (int i = 0; i < config->led_count; i++) {
-      if (state_on) {
-        set_target_pixel(i, colors_target[i]);
-        // // Set color
-        // pixels_target[i] = colors_target[i];
-
-        // // Mix color with brightness
-        // pixels_target[i].r = (double)pixels_target[i].r * (double)state_brightness / (double)255;
-        // pixels_target[i].g = (double)pixels_target[i].g * (double)state_brightness / (double)255;
-        // pixels_target[i].b = (double)pixels_target[i].b * (double)state_brightness / (double)255;
-        // pixels_target[i].w = (double)pixels_target[i].w * (double)state_brightness / (double)255;
-      } else {
-        set_target_pixel(i, color_rgbw_black);
-        // pixels_target[i] = ColorRGBW({
-        //     .r = 0,
-        //     .g = 0,
-        //     .b = 0,
-        //     .w = 0,
-        // });
-      }
+  constexpr double const_log(double x) {
+    // Reduce x into [0.5, 1], then ln(x) = 2 * atanh((x - 1) / (x + 1))
+    int halvings = 0;
+    while (x < 0.5) {
+      x *= 2;
+      halvings++;
     }
 
-    // Set animating to true and start time
-    animating = true;
-    animating_start_ms = millis();
+    double y = (x - 1) / (x + 1);
+    double sum = 0;
+    double term = y;
+    for (int n = 1; n < 30; n += 2) {
+      sum += term / n;
+      term *= y * y;
+    }
+    return 2 * sum - halvings * 0.6931471805599453;
   }
 
-  void animate_step() {
-    animating_delta_current = (((double)(millis() - animating_start_ms) / (double)ANIMATE_SPEED)) * 255;
+  struct OutputTable {
+    uint8_t values[256];
+  };
 
-    if (animating_delta_previous != animating_delta_current) {
-      animating_delta_previous = animating_delta_current;
+  // Gamma correction followed by a white balance scale for one channel
+  constexpr OutputTable make_output_table(uint8_t white_balance) {
+    OutputTable table = {};
+    for (int i = 1; i < 256; i++) {
+      double value = const_exp(GAMMA * const_log(i / 255.0)) * white_balance + 0.5;
 
-      // If animating is finished
-      if (animating_delta_current >= 255) {
-        // Reset animating variables
-        animating = false;
-        animating_start_ms = 0;
-        animating_delta_previous = 0;
-        animating_delta_current = 0;
+      // Keep lit inputs lit, so low brightness levels don't turn black
+      table.values[i] = (white_balance > 0 && value < 1) ? 1 : (uint8_t)value;
+    }
+    return table;
+  }
 
-        // Set previous pixels to target pixels
-        for (int i = 0; i < get_count(); i++) {
-          pixels_current[i] = pixels_target[i];
-        }
-      } else {
-        // Interpolate pixels
-        for (int i = 0; i < get_count(); i++) {
-          ColorRGBW pixel_previous = pixels_previous[i];
-          ColorRGBW pixel_target = pixels_target[i];
-
-          double deltad = (double)animating_delta_current / (double)255;
-
-          uint8_t mixed_r = (double)pixel_previous.r * (double)(1 - deltad) + (double)pixel_target.r * deltad;
-          uint8_t mixed_g = (double)pixel_previous.g * (double)(1 - deltad) + (double)pixel_target.g * deltad;
-          uint8_t mixed_b = (double)pixel_previous.b * (double)(1 - deltad) + (double)pixel_target.b * deltad;
-          uint8_t mixed_w = (double)pixel_previous.w * (double)(1 - deltad) + (double)pixel_target.w * deltad;
-
-          pixels_current[i] = ColorRGBW{
-              .r = mixed_r,
-              .g = mixed_g,
-              .b = mixed_b,
-              .w = mixed_w,
-          };
-        }
-      }
+  constexpr OutputTable output_table_r = make_output_table(WHITE_BALANCE_R);
+  constexpr OutputTable output_table_g = make_output_table(WHITE_BALANCE_G);
+  constexpr OutputTable output_table_b = make_output_table(WHITE_BALANCE_B);
+  constexpr OutputTable output_table_w = make_output_table(WHITE_BALANCE_W);
 
-      // Write colors to the strip
-      for (int i = 0; i < get_count(); i++) {
-        uint32_t color = strip->Color(
-            pixels_current[i].r,
-            pixels_current[i].g,
-            pixels_current[i].b,
-            pixels_current[i].w);
-        strip->setPixelColor(i, color);
-      }
-      strip->show();
+  void update_brightness_table(Segment &segment) {
+    for (int i = 0; i < 256; i++) {
+      segment.brightness_table[i] = i * segment.state_brightness / 255;
     }
   }
 
-  void set_color(ColorRGBW color) {
-    // Stop lua
-    if (lua_running) {
-      stop_lua();
-    }
+  void set_target_pixel(Segment &segment, int i, const ColorRGBW &color) {
+    // Mix color with brightness
+    pixels_target[i] = ColorRGBW{
+        .r = segment.brightness_table[color.r],
+        .g = segment.brightness_table[color.g],
+        .b = segment.brightness_table[color.b],
+        .w = segment.brightness_table[color.w],
+    };
+  }
 
-    // Set state
-    state_on = true;
-    state_colors.clear();
-    state_colors.push_back(color);
+  // The part of the pixel buffers that belongs to a segment. In palette mode,
+  // where there is only one segment, that is the whole palette.
+  int get_buffer_start(const Segment &segment) {
+    return palette_size > 0 ? 0 : segment.start;
+  }
 
-    // Set target colors
-    for (int i = 0; i < get_count(); i++) {
-      colors_target[i] = color;
+  int get_buffer_end(const Segment &segment) {
+    return palette_size > 0 ? palette_size : segment.start + segment.length;
+  }
+
+  void blend_pixels(ColorRGBW *out, const ColorRGBW *from, const ColorRGBW *to, int count, uint8_t delta) {
+    for (int i = 0; i < count; i++) {
+      out[i] = blend_pixel(from[i], to[i], delta);
     }
+  }
 
-    // Animate
-    animate();
+  void write_palette_pixels(Adafruit_NeoPixel *target, const ColorRGBW *palette, int size, const uint8_t *indices, uint8_t offset, int count) {
+    // Expand the palette into the strip through the output tables
+    uint8_t mask = size - 1;
+    for (int i = 0; i < count; i++) {
+      const ColorRGBW &color = palette[(uint8_t)(indices[i] + offset) & mask];
+      target->setPixelColor(i,
+          output_table_r.values[color.r],
+          output_table_g.values[color.g],
+          output_table_b.values[color.b],
+          output_table_w.values[color.w]);
+    }
+  }
 
-    // Emit state
-    timer.setTimeout(emit_state, 1);
+  void write_pixels(Adafruit_NeoPixel *target, const ColorRGBW *pixels, int start, int end) {
+    // Write colors to the strip through the output tables
+    for (int i = start; i < end; i++) {
+      target->setPixelColor(i,
+          output_table_r.values[pixels[i].r],
+          output_table_g.values[pixels[i].g],
+          output_table_b.values[pixels[i].b],
+          output_table_w.values[pixels[i].w]);
+    }
   }
 
-  void set_gradient(/*ColorRGBW colors[]*/) {
-    // Stop lua
-    if (lua_running) {
-      stop_lua();
+  // Writes the logical pixels in [start, end) to every output showing them
+  void write_outputs(const ColorRGBW *pixels, int start, int end) {
+    for (Output &output : outputs) {
+      int from = std::max(start, (int)output.offset);
+      int to = std::min(end, output.offset + output.count);
+      if (from < to) {
+        write_pixels(output.strip, pixels + output.offset, from - output.offset, to - output.offset);
+      }
     }
+  }
 
-    // Set state
-    state_on = true;
-    // for (int i = 0; i < get_count(); i++) {
-    //   state_colors[i] = colors[i];
-    // }
+  void write_palette_outputs() {
+    for (Output &output : outputs) {
+      write_palette_pixels(output.strip, pixels_current, palette_size, pixel_indices + output.offset, palette_offset, output.count);
+    }
+  }
 
-    // Animate
-    animate();
+  void mark_frame_dirty(int start, int end) {
+    if (frame_dirty_start >= frame_dirty_end) {
+      frame_dirty_start = start;
+      frame_dirty_end = end;
+    } else {
+      frame_dirty_start = std::min(frame_dirty_start, start);
+      frame_dirty_end = std::max(frame_dirty_end, end);
+    }
+  }
 
-    // Emit state
-    timer.setTimeout(emit_state, 1);
+  void clear_outputs() {
+    for (Output &output : outputs) {
+      output.strip->clear();
+      output.strip->show();
+      output.shown_hash_valid = false;
+    }
   }
 
-  int get_count() {
-    return config->led_count;
+  void update_targets(Segment &segment) {
+    // Set target pixels to state pixels
+    int end = get_buffer_end(segment);
+    for (int i = get_buffer_start(segment); i < end; i++) {
+      if (segment.state_on) {
+        set_target_pixel(segment, i, colors_target[i]);
+      } else {
+        set_target_pixel(segment, i, color_rgbw_black);
+      }
+    }
   }
 
-  void set_count(int count) {
-    // Save new count
-    config->led_count = count;
-    config.save();
+  void animate(Segment &segment) {
+    // Crossfade once, from the current pixels to the state the whole batch ends in
+    if (batch_depth > 0) {
+      segment.animate_pending = true;
+      return;
+    }
 
-    // Clear & Setup
-    strip->clear();
-    strip->show();
-    led::setup();
+    // Set current pixels to previous pixels
+    int end = get_buffer_end(segment);
+    for (int i = get_buffer_start(segment); i < end; i++) {
+      pixels_previous[i] = pixels_current[i];
+    }
 
-    // Update nupnp
-    timer.setTimeout(nupnp::sync, 1000);
+    update_targets(segment);
 
-    // Emit config
-    timer.setTimeout(emit_config, 1);
+    // Set animating to true and start time
+    segment.animating = true;
+    segment.animating_start_ms = millis();
   }
 
-  void set_on(bool on) {
-    state_on = on;
+  void begin_batch() {
+    batch_depth++;
+  }
 
-    // Animate
-    animate();
+  void end_batch() {
+    if (--batch_depth > 0) {
+      return;
+    }
 
-    // Emit state
-    timer.setTimeout(emit_state, 1);
+    for (Segment &segment : segments) {
+      if (segment.animate_pending) {
+        segment.animate_pending = false;
+        animate(segment);
+      }
+    }
   }
 
-  void set_brightness(uint8_t brightness) {
-    state_on = true;
-    state_brightness = brightness;
-
-    // Animate
-    animate();
+  // Emits the state once, however many changes are made before the timer fires
+  void schedule_emit_state() {
+    if (emit_state_pending) {
+      return;
+    }
 
-    // Emit state
+    emit_state_pending = true;
     timer.setTimeout(emit_state, 1);
   }
 
-  int get_pin() {
-    return config->led_pin;
-  }
-
-  void set_pin(uint8_t pin) {
-    // Save new pin
-    config->led_pin = pin;
-    config.save();
-
-    // Clear & Setup
-    strip->clear();
-    strip->show();
-    led::setup();
+  // Returns true when the segment's part of pixels_current has changed.
+  // `targets_changed` forces a new frame when a producer has rewritten the target pixels.
+  bool animate_step(Segment &segment, bool targets_changed) {
+    int start = get_buffer_start(segment);
+    int length = get_buffer_end(segment) - start;
 
-    // Emit config
-    timer.setTimeout(emit_config, 1);
-  }
+    if (!segment.animating) {
+      if (targets_changed) {
+        memcpy(pixels_current + start, pixels_target + start, length * sizeof(ColorRGBW));
+      }
 
-  String get_type() {
-    if (config->led_type == LedType::SK6812) {
-      return "SK6812";
-    } else if (config->led_type == LedType::WS2812) {
-      return "WS2812";
-    } else {
-      return "unknown";
+      return targets_changed;
     }
-  }
 
-  bool set_type(String type) {
-    if (type.equals("SK6812")) {
-      // Save
-      config->led_type = LedType::SK6812;
-      config.save();
+    segment.animating_delta_current = (millis() - segment.animating_start_ms) * 255 / ANIMATE_SPEED;
 
-      // Clear & Setup
-      strip->clear();
-      strip->show();
-      led::setup();
+    if (segment.animating_delta_previous != segment.animating_delta_current || targets_changed) {
+      segment.animating_delta_previous = segment.animating_delta_current;
 
-      return true;
-    } else if (type.equals("WS2812")) {
-      // Save
-      config->led_type = LedType::WS2812;
-      config.save();
+      // If animating is finished
+      if (segment.animating_delta_current >= 255) {
+        // Reset animating variables
+        segment.animating = false;
+        segment.animating_start_ms = 0;
+        segment.animating_delta_previous = 0;
+        segment.animating_delta_current = 0;
 
-      // Clear & Setup
-      strip->clear();
-      strip->show();
-      led::setup();
+        // Set previous pixels to target pixels
+        memcpy(pixels_current + start, pixels_target + start, length * sizeof(ColorRGBW));
+      } else {
+        // Interpolate pixels
+        blend_pixels(pixels_current + start, pixels_previous + start, pixels_target + start, length, segment.animating_delta_current);
+      }
 
       return true;
-    } else {
-      return false;
     }
 
-    // Emit config
-    timer.setTimeout(emit_config, 1);
+    return false;
   }
 
-  JsonDocument get_state() {
-    JsonDocument result;
+  /*
+   * Effects
+   */
+
+  // Integer hash, for stateless per-pixel randomness
+  inline uint32_t hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+  }
 
-    result["on"] = state_on;
-    result["brightness"] = state_brightness;
+  inline ColorRGBW color_hsv(uint16_t h, uint8_t s, uint8_t v) {
+    uint32_t color = Adafruit_NeoPixel::ColorHSV(h, s, v);
+    return ColorRGBW{
+        .r = (uint8_t)(color >> 16),
+        .g = (uint8_t)(color >> 8),
+        .b = (uint8_t)color,
+        .w = 0,
+    };
+  }
 
-    JsonArray colors = result["colors"].to<JsonArray>();
-    for (int i = 0; i < state_colors.size(); i++) {
-      JsonObject pixel = colors.add<JsonObject>();
-      pixel["r"] = state_colors[i].r;
-      pixel["g"] = state_colors[i].g;
-      pixel["b"] = state_colors[i].b;
-      pixel["w"] = state_colors[i].w;
-    }
+  void render_rainbow(Segment &segment, uint64_t t) {
+    // Density sets the number of rainbows across the strip
+    ColorRGBW *out = colors_target + segment.start;
+    const EffectParams &effect_params = segment.effect_params;
+    int count = segment.length;
+    uint32_t hue_step = ((uint32_t)65536 * (1 + effect_params.density / 32)) / count;
+    uint32_t hue_offset = t * effect_params.speed / 8;
 
-    return result;
+    for (int i = 0; i < count; i++) {
+      out[i] = color_hsv(hue_offset + i * hue_step, 255, 255);
+    }
   }
 
-  void emit_state() {
-    JsonDocument state = get_state();
-    emit_event("led.state", state);
+  void render_chase(Segment &segment, uint64_t t) {
+    // Density sets the spacing between lit pixels
+    ColorRGBW *out = colors_target + segment.start;
+    const EffectParams &effect_params = segment.effect_params;
+    int count = segment.length;
+    uint32_t spacing = 2 + (255 - effect_params.density) / 32;
+    uint32_t position = (t * effect_params.speed) >> 11;
+
+    for (int i = 0; i < count; i++) {
+      out[i] = (i + position) % spacing == 0
+          ? effect_params.color
+          : color_rgbw_black;
+    }
   }
 
-  JsonDocument get_config() {
-    JsonDocument result;
+  void render_twinkle(Segment &segment, uint64_t t) {
+    // Density sets the chance of a pixel lighting up in each cycle
+    ColorRGBW *out = colors_target + segment.start;
+    const EffectParams &effect_params = segment.effect_params;
+    int count = segment.length;
+    uint32_t time = (t * effect_params.speed) >> 10;
 
-    result["count"] = led::get_count();
-    result["pin"] = led::get_pin();
-    result["type"] = led::get_type();
+    for (int i = 0; i < count; i++) {
+      uint32_t phase = time + hash32(i);
+      uint32_t cycle = phase >> 8;
 
-    return result;
+      if ((hash32(i ^ (cycle * 2654435761u)) & 0xFF) >= effect_params.density) {
+        out[i] = color_rgbw_black;
+        continue;
+      }
+
+      // Only the upper half of the wave is lit
+      uint8_t wave = Adafruit_NeoPixel::sine8(phase);
+      uint8_t level = wave > 128 ? (wave - 128) * 2 : 0;
+      out[i] = blend_pixel(color_rgbw_black, effect_params.color, level);
+    }
   }
 
-  void emit_config() {
-    JsonDocument config = get_config();
-    ::emit_event("led.config", config);
+  void render_fire(Segment &segment, uint64_t t) {
+    // Heat simulation. Density sets how often sparks appear and how slowly the fire cools.
+    ColorRGBW *out = colors_target + segment.start;
+    const EffectParams &effect_params = segment.effect_params;
+    int count = segment.length;
+    uint8_t *heat = segment.effect_state.data();
+    uint8_t cooling = 20 + (255 - effect_params.density) / 3;
+    uint8_t sparking = 50 + effect_params.density / 2;
+
+    // Speed sets the simulation step rate
+    uint32_t step = t * (effect_params.speed + 16) / 4096;
+    if (step == segment.effect_frame) {
+      return;
+    }
+    segment.effect_frame = step;
+
+    // Cool down every cell a little
+    for (int i = 0; i < count; i++) {
+      int cooldown = random(0, (cooling * 10) / count + 2);
+      heat[i] = heat[i] > cooldown ? heat[i] - cooldown : 0;
+    }
+
+    // Heat drifts up
+    for (int i = count - 1; i >= 2; i--) {
+      heat[i] = (heat[i - 1] + 2 * heat[i - 2]) / 3;
+    }
+
+    // Ignite new sparks near the bottom
+    if (random(255) < sparking) {
+      int i = random(std::min(count, 7));
+      heat[i] = std::min(255, heat[i] + (int)random(160, 255));
+    }
+
+    // Map heat to black, red, yellow and white
+    for (int i = 0; i < count; i++) {
+      uint8_t level = (heat[i] * 191) >> 8;
+      uint8_t ramp = (level & 0x3F) << 2;
+
+      if (level & 0x80) {
+        out[i] = ColorRGBW{.r = 255, .g = 255, .b = ramp, .w = 0};
+      } else if (level & 0x40) {
+        out[i] = ColorRGBW{.r = 255, .g = ramp, .b = 0, .w = 0};
+      } else {
+        out[i] = ColorRGBW{.r = ramp, .g = 0, .b = 0, .w = 0};
+      }
+    }
   }
 
-  void stop_lua() {
-    if (lua_running) {
-      timer.cancel(lua_timer);
-      lua_close(lua_state);
+  void render_breathe(Segment &segment, uint64_t t) {
+    // Density sets the lowest level
+    ColorRGBW *out = colors_target + segment.start;
+    const EffectParams &effect_params = segment.effect_params;
+    int count = segment.length;
+    uint8_t wave = Adafruit_NeoPixel::sine8((t * effect_params.speed) >> 11);
+    uint8_t level = effect_params.density / 2 + ((wave * (255 - effect_params.density / 2)) >> 8);
+    ColorRGBW color = blend_pixel(color_rgbw_black, effect_params.color, level);
+
+    for (int i = 0; i < count; i++) {
+      out[i] = color;
     }
+  }
 
-    lua_running = false;
+  void render_comet(Segment &segment, uint64_t t) {
+    // Density sets the length of the tail
+    ColorRGBW *out = colors_target + segment.start;
+    const EffectParams &effect_params = segment.effect_params;
+    int count = segment.length;
+    int tail = 1 + effect_params.density * count / 512;
+    int head = ((t * effect_params.speed) >> 11) % (count + tail);
+
+    for (int i = 0; i < count; i++) {
+      int distance = head - i;
+      if (distance < 0 || distance >= tail) {
+        out[i] = color_rgbw_black;
+      } else {
+        out[i] = blend_pixel(color_rgbw_black, effect_params.color, 255 - distance * 255 / tail);
+      }
+    }
   }
 
-  void start_lua(String script) {
-    lua_state = luaL_newstate();
-    luaopen_base(lua_state);
-    luaopen_math(lua_state);
-    lua_register(lua_state, "luxio_set_pixel_color_hsv", [](lua_State *L) {
-      uint8_t pixel = luaL_checkinteger(L, 1);
-      uint16_t h = luaL_checkinteger(L, 2);
-      uint8_t s = luaL_checkinteger(L, 3);
-      uint8_t v = luaL_checkinteger(L, 4);
+  const Effect effects[] = {
+      {"rainbow", render_rainbow},
+      {"chase", render_chase},
+      {"twinkle", render_twinkle},
+      {"fire", render_fire},
+      {"breathe", render_breathe},
+      {"comet", render_comet},
+  };
+
+  const Effect *find_effect(String name) {
+    for (const Effect &candidate : effects) {
+      if (name.equals(candidate.name)) {
+        return &candidate;
+      }
+    }
 
-      // TODO: Compensate for brightness
-      strip->setPixelColor(pixel, strip->ColorHSV(h, s, v));
+    return NULL;
+  }
 
-      return 0;
-    });
-    lua_register(lua_state, "luxio_set_pixel_color_rgb", [](lua_State *L) {
-      uint8_t pixel = luaL_checkinteger(L, 1);
-      uint8_t r = luaL_checkinteger(L, 2);
-      uint8_t g = luaL_checkinteger(L, 3);
-      uint8_t b = luaL_checkinteger(L, 4);
+  void stop_effect(Segment &segment) {
+    segment.effect = NULL;
+    segment.effect_state.clear();
+    segment.effect_state.shrink_to_fit();
+  }
 
-      // TODO: Compensate for brightness
-      strip->setPixelColor(pixel, strip->Color(r, g, b, 0));
+  // Producers render segments front to back, reversed segments are flipped afterwards
+  void reverse_colors(Segment &segment) {
+    if (segment.reverse) {
+      std::reverse(colors_target + segment.start, colors_target + segment.start + segment.length);
+    }
+  }
 
-      return 0;
-    });
-    lua_register(lua_state, "luxio_set_pixel_color_rgbw", [](lua_State *L) {
-      uint8_t pixel = luaL_checkinteger(L, 1);
-      uint8_t r = luaL_checkinteger(L, 2);
-      uint8_t g = luaL_checkinteger(L, 3);
-      uint8_t b = luaL_checkinteger(L, 4);
-      uint8_t w = luaL_checkinteger(L, 5);
+  void render_effect(Segment &segment, uint64_t t) {
+    // Effects divide by the length, and have nothing to draw without LEDs
+    if (segment.length == 0) {
+      return;
+    }
 
-      // TODO: Compensate for brightness
-      strip->setPixelColor(pixel, strip->Color(r, g, b, w));
+    segment.effect->render(segment, t);
+    reverse_colors(segment);
+  }
 
-      return 0;
-    });
-    lua_register(lua_state, "luxio_get_pixel_count", [](lua_State *L) {
-      lua_pushinteger(L, strip->numPixels());
-      return 1;
-    });
-    lua_register(lua_state, "luxio_show", [](lua_State *L) {
-      strip->show();
-      return 0;
-    });
-    lua_register(lua_state, "luxio_done", [](lua_State *L) {
-      // TODO: Test this
-      stop_lua();
-      animate();
+  // Renders the running effect into the target pixels. Returns true when they changed.
+  bool effect_step(Segment &segment) {
+    // Nothing is visible while the segment is off
+    if (!segment.state_on && !segment.animating) {
+      return false;
+    }
 
-      return 0;
-    });
-    lua_register(lua_state, "millis", [](lua_State *L) -> int {
-      lua_pushnumber(L, (lua_Number)millis());
-      return 1;
-    });
-    lua_register(lua_state, "print", [](lua_State *L) -> int {
-      String message = luaL_checkstring(L, 1);
-      debug("lua: " + message);
-      return 0;
-    });
+    // Accumulated every frame, so it keeps counting when millis() wraps
+    unsigned long now = millis();
+    segment.effect_ms += now - segment.effect_last_ms;
+    segment.effect_last_ms = now;
 
-    // Load the script once
-    if (luaL_loadbuffer(lua_state, script.c_str(), script.length(), "line")) {
-      debug("# lua load error:\n" + String(lua_tostring(lua_state, -1)));
-      lua_pop(lua_state, 1);
+    render_effect(segment, segment.effect_ms);
+    update_targets(segment);
+
+    return true;
+  }
+
+  /*
+   * Gradients
+   */
+
+  struct GradientStop {
+    ColorRGBW color;
+    uint32_t position;  // 0 (first pixel) to 65536 (last pixel)
+  };
+
+  struct ColorHSVW {
+    uint16_t h;
+    uint8_t s;
+    uint8_t v;
+    uint8_t w;
+  };
+
+  // Convert to the hue range used by Adafruit_NeoPixel::ColorHSV, where red is 0
+  ColorHSVW color_to_hsv(const ColorRGBW &color) {
+    uint8_t max = std::max(color.r, std::max(color.g, color.b));
+    uint8_t min = std::min(color.r, std::min(color.g, color.b));
+    int delta = max - min;
+
+    ColorHSVW result = {.h = 0, .s = 0, .v = max, .w = color.w};
+    if (delta == 0) {
+      return result;
+    }
+
+    result.s = delta * 255 / max;
+    if (max == color.r) {
+      result.h = (color.g - color.b) * 10923 / delta;
+    } else if (max == color.g) {
+      result.h = 21845 + (color.b - color.r) * 10923 / delta;
+    } else {
+      result.h = 43691 + (color.r - color.g) * 10923 / delta;
+    }
+
+    return result;
+  }
+
+  // Fill `count` pixels with a gradient through `stops`, which must be sorted by position.
+  // Every segment between two stops is stepped in 16.16 fixed point, so there is no
+  // division or float math per pixel.
+  void fill_gradient(ColorRGBW *out, int count, const GradientStop *stops, int num_stops, bool hsv) {
+    if (num_stops == 1 || count == 1) {
+      for (int i = 0; i < count; i++) {
+        out[i] = stops[0].color;
+      }
       return;
     }
 
-    // Execute the script every time
-    lua_timer = timer.setInterval([]() {
-      lua_pushvalue(lua_state, -1);
-      if (lua_pcall(lua_state, 0, 0, 0) != 0) {
-        debug("# lua run error:\n" + String(lua_tostring(lua_state, -1)));
-        lua_pop(lua_state, 1);
-        stop_lua();
+    // Pixels before the first stop take its color
+    int i = 0;
+    uint32_t first = stops[0].position * (count - 1);
+    while (i < count && ((uint32_t)i << 16) < first) {
+      out[i++] = stops[0].color;
+    }
+
+    for (int k = 0; k + 1 < num_stops; k++) {
+      const GradientStop &from = stops[k];
+      const GradientStop &to = stops[k + 1];
+
+      // Stop positions in pixels, as 16.16 fixed point
+      uint32_t x0 = from.position * (count - 1);
+      uint32_t x1 = to.position * (count - 1);
+      if (x1 <= x0) {
+        continue;
       }
-    },
-        1000 / 60);  // 60 fps
 
-    lua_running = true;
+      // Blend factor (0-255) per pixel, as 16.16 fixed point
+      uint64_t step = ((uint64_t)255 << 32) / (x1 - x0);
+      uint64_t delta = (((uint64_t)(((uint32_t)i << 16) - x0)) * step) >> 16;
+
+      ColorHSVW from_hsv;
+      ColorRGBW from_svw;
+      ColorRGBW to_svw;
+      int32_t hue_distance = 0;
+      if (hsv) {
+        from_hsv = color_to_hsv(from.color);
+        ColorHSVW to_hsv = color_to_hsv(to.color);
+
+        // Take the shortest way around the hue circle
+        hue_distance = (int16_t)(to_hsv.h - from_hsv.h);
+        from_svw = ColorRGBW{.r = from_hsv.s, .g = from_hsv.v, .b = 0, .w = from_hsv.w};
+        to_svw = ColorRGBW{.r = to_hsv.s, .g = to_hsv.v, .b = 0, .w = to_hsv.w};
+      }
 
-    // TODO: Animate from previous state to animation
-  }
+      while (i < count && ((uint32_t)i << 16) <= x1) {
+        uint8_t t = std::min(delta >> 16, (uint64_t)255);
 
-  void setup() {
-    int led_count = get_count();
-    int led_pin = get_pin();
-    int led_type;
+        if (hsv) {
+          ColorRGBW svw = blend_pixel(from_svw, to_svw, t);
+          out[i] = color_hsv(from_hsv.h + ((hue_distance * t * 257) >> 16), svw.r, svw.g);
+          out[i].w = svw.w;
+        } else {
+          out[i] = blend_pixel(from.color, to.color, t);
+        }
 
-    switch (config->led_type) {
-      case LedType::SK6812: {
-        led_type = NEO_GRBW + NEO_KHZ800;
-        initial_color = color_rgbw_white;
-        break;
+        i++;
+        delta += step;
       }
-      case LedType::WS2812:
-      default: {
-        led_type = NEO_GRB + NEO_KHZ800;
-        initial_color = color_rgb_white;
-        break;
+    }
+
+    // Pixels after the last stop take its color
+    while (i < count) {
+      out[i++] = stops[num_stops - 1].color;
+    }
+  }
+
+  /*
+   * Palette
+   */
+
+  void spread_indices() {
+    int count = get_count();
+    for (int i = 0; i < count; i++) {
+      pixel_indices[i] = (uint32_t)i * palette_size / count;
+    }
+  }
+
+  uint8_t get_palette_offset() {
+    if (palette_speed == 0) {
+      return 0;
+    }
+
+    // Wrap within the palette, also when rotating backwards
+    int32_t steps = (uint64_t)(millis() - palette_start_ms) * abs(palette_speed) / 1000 % palette_size;
+    return palette_speed > 0 ? steps : (palette_size - steps) % palette_size;
+  }
+
+  void set_palette(const std::vector<ColorRGBW> &colors, const std::vector<uint8_t> &indices, int speed) {
+    // Palette mode has a single segment
+    Segment &segment = segments[0];
+
+    // Stop effect
+    stop_effect(segment);
+
+    // Set state
+    segment.state_on = true;
+    segment.state_colors = colors;
+
+    // Repeat the colors over the whole palette
+    for (int i = 0; i < palette_size; i++) {
+      colors_target[i] = colors[i % colors.size()];
+    }
+
+    if (indices.empty()) {
+      spread_indices();
+    } else {
+      for (int i = 0; i < get_count(); i++) {
+        pixel_indices[i] = i < (int)indices.size() ? indices[i] : 0;
       }
     }
 
-    debug("Initializing LED strip with " + String(led_count) + " LEDs on pin " + String(led_pin) + " and type " + String(led_type));
+    palette_speed = speed;
+    palette_start_ms = millis();
 
-    strip = new Adafruit_NeoPixel(led_count, led_pin, led_type);
-    strip->begin();
-    strip->setBrightness(DEFAULT_LED_BRIGHTNESS);
+    // Animate
+    animate(segment);
 
-    // Make strip black
-    strip->fill(strip->Color(0, 0, 0, 0));
-    strip->show();
+    // Emit state
+    schedule_emit_state();
+  }
 
-    // Animate to initial color
-    set_color(initial_color);
+  int get_palette_size() {
+    return config->led_palette_size;
+  }
 
-    // Setup LUA
+  void set_palette_size(int size) {
+    // Save new palette size
+    config->led_palette_size = size;
+    config.save();
 
-    // TODO: Register method `luxio_done` to stop the animation and revert to the previous state
+    // Clear & Setup
+    clear_outputs();
+    led::setup();
+
+    // Emit config
+    timer.setTimeout(emit_config, 1);
   }
 
-  void loop() {
-    if (animating) {
-      animate_step();
+  void stop_lua(Segment &segment) {
+    if (lua_running && &segment == &segments[lua_segment]) {
+      stop_lua();
     }
+  }
 
-    if (lua_running) {
-      // Run every 1/60th of a second
+  void set_color(Segment &segment, ColorRGBW color) {
+    // Stop lua
+    stop_lua(segment);
+
+    // Stop effect
+    stop_effect(segment);
+
+    // Set state
+    segment.state_on = true;
+    segment.state_colors.clear();
+    segment.state_colors.push_back(color);
+
+    // Set target colors
+    int end = get_buffer_end(segment);
+    for (int i = get_buffer_start(segment); i < end; i++) {
+      colors_target[i] = color;
     }
+    palette_speed = 0;
+
+    // Animate
+    animate(segment);
+
+    // Emit state
+    schedule_emit_state();
   }
 
-  namespace api {
+  void set_gradient(Segment &segment, const std::vector<GradientStop> &stops, bool hsv) {
+    // Stop lua
+    stop_lua(segment);
 
-    APIResponse get_state(JsonVariant params) {
-      return APIResponse{
-          .result = led::get_state(),
-      };
+    // Stop effect
+    stop_effect(segment);
+
+    // Set state
+    segment.state_on = true;
+    segment.state_colors.clear();
+    for (const GradientStop &stop : stops) {
+      segment.state_colors.push_back(stop.color);
     }
 
-    APIResponse get_config(JsonVariant params) {
-      return APIResponse{
-          .result = led::get_config(),
-      };
+    // Set target colors. In palette mode the gradient is sampled into the palette,
+    // and the pixels are spread evenly over it.
+    int start = get_buffer_start(segment);
+    fill_gradient(colors_target + start, get_buffer_end(segment) - start, stops.data(), stops.size(), hsv);
+    if (palette_size > 0) {
+      spread_indices();
+      palette_speed = 0;
+    } else {
+      reverse_colors(segment);
     }
 
-    APIResponse get_count(JsonVariant params) {
-      JsonDocument result;
-      result.set(led::get_count());
+    // Animate
+    animate(segment);
 
-      return APIResponse{
-          .result = result,
-      };
+    // Emit state
+    schedule_emit_state();
+  }
+
+  void set_animation(Segment &segment, const Effect *next, EffectParams params) {
+    // Stop lua
+    stop_lua(segment);
+
+    // Set state
+    segment.state_on = true;
+    segment.effect = next;
+    segment.effect_params = params;
+    segment.effect_ms = 0;
+    segment.effect_last_ms = millis();
+    segment.effect_frame = 0;
+    segment.effect_state.assign(segment.length, 0);
+
+    // Crossfade into the effect, which renders a new target every frame
+    render_effect(segment, 0);
+    animate(segment);
+
+    // Emit state
+    schedule_emit_state();
+  }
+
+  int get_count() {
+    return config->led_count;
+  }
+
+  int get_buffer_length() {
+    return palette_size > 0 ? palette_size : get_count();
+  }
+
+  size_t get_arena_size() {
+    return pixel_arena_size;
+  }
+
+  size_t get_arena_size(int count, int palette_size) {
+    if (palette_size > 0) {
+      return palette_size * PIXEL_BUFFERS * sizeof(ColorRGBW) + count;
     }
 
-    APIResponse set_count(JsonVariant params) {
-      if (!params["count"].is<int>()) {
-        return APIResponse{
-            .err = "invalid_count",
-        };
+    return count * (PIXEL_BUFFERS + FRAME_BUFFERS) * sizeof(ColorRGBW);
+  }
+
+  int get_max_count(int palette_size) {
+    // Free heap once the current arena and strip buffers have been released
+    int available = (int)ESP.getFreeHeap() - HEAP_RESERVE + (int)pixel_arena_size;
+    for (Output &output : outputs) {
+      available += output.count * output.bytes_per_pixel;
+    }
+
+    // Pixel buffers and frame or palette index, plus the strip buffer
+    available -= get_arena_size(0, palette_size);
+    int bytes_per_led = (palette_size > 0 ? 1 : (PIXEL_BUFFERS + FRAME_BUFFERS) * sizeof(ColorRGBW)) + 4;
+
+    if (available < bytes_per_led) {
+      return 0;
+    }
+
+    return std::min(available / bytes_per_led, (int)UINT16_MAX);
+  }
+
+  int get_max_count() {
+    return get_max_count(palette_size);
+  }
+
+  bool allocate_pixels(int count) {
+    // Release the previous arena first, so its memory can be reused
+    free(pixel_arena);
+    pixel_arena = NULL;
+    pixel_arena_size = 0;
+
+    size_t size = get_arena_size(count, palette_size);
+    pixel_arena = (ColorRGBW *)calloc(size, 1);
+    if (pixel_arena == NULL) {
+      pixels_previous = pixels_current = pixels_target = colors_target = NULL;
+      frame_pixels = NULL;
+      pixel_indices = NULL;
+      return false;
+    }
+
+    // Palette entries or pixels first, followed by the palette indices or the frame
+    int length = palette_size > 0 ? palette_size : count;
+    pixel_arena_size = size;
+    pixels_previous = pixel_arena;
+    pixels_current = pixel_arena + length;
+    pixels_target = pixel_arena + length * 2;
+    colors_target = pixel_arena + length * 3;
+    pixel_indices = palette_size > 0 ? (uint8_t *)(pixel_arena + length * 4) : NULL;
+    frame_pixels = palette_size > 0 ? NULL : pixel_arena + length * 4;
+    frame_dirty_start = frame_dirty_end = 0;
+
+    return true;
+  }
+
+  void set_count(int count) {
+    // Save new count. Segments are laid out for the old count, so fall back to a single segment.
+    config->led_count = count;
+    config->led_segment_count = 0;
+    config->led_output_count = 0;
+    config.save();
+
+    // Clear & Setup
+    clear_outputs();
+    led::setup();
+
+    // Update nupnp
+    timer.setTimeout(nupnp::sync, 1000);
+
+    // Emit config
+    timer.setTimeout(emit_config, 1);
+  }
+
+  void set_on(Segment &segment, bool on) {
+    segment.state_on = on;
+
+    // Animate
+    animate(segment);
+
+    // Emit state
+    schedule_emit_state();
+  }
+
+  void set_brightness(Segment &segment, uint8_t brightness) {
+    segment.state_on = true;
+    segment.state_brightness = brightness;
+    update_brightness_table(segment);
+
+    // Animate
+    animate(segment);
+
+    // Emit state
+    schedule_emit_state();
+  }
+
+  // Sanitizes the configured segments, falling back to a single segment over the whole strip
+  void load_segment_config() {
+    int count = config->led_segment_count;
+    bool valid = count >= 1 && count <= MAX_LED_SEGMENTS && (count == 1 || palette_size == 0);
+
+    // Segments must lie on the strip and can't overlap
+    for (int i = 0; valid && i < count; i++) {
+      const SegmentConfig &segment = config->led_segments[i];
+      valid = segment.length >= 1 && segment.start + segment.length <= get_count();
+
+      for (int j = 0; valid && j < i; j++) {
+        const SegmentConfig &other = config->led_segments[j];
+        valid = segment.start >= other.start + other.length || other.start >= segment.start + segment.length;
       }
+    }
 
-      int count = params["count"].as<int>();
-      if (count < 1 || count > MAX_LED_COUNT) {
-        return APIResponse{
-            .err = "count_out_of_range",
-        };
+    if (!valid) {
+      config->led_segment_count = 0;
+    }
+  }
+
+  std::vector<SegmentConfig> get_segments() {
+    if (config->led_segment_count == 0) {
+      return {SegmentConfig{.start = 0, .length = (uint16_t)get_count(), .reverse = false}};
+    }
+
+    return std::vector<SegmentConfig>(config->led_segments, config->led_segments + config->led_segment_count);
+  }
+
+  // Rebuilds the segments from the config. On and brightness carry over from the previous segments.
+  void setup_segments() {
+    stop_lua();
+
+    std::vector<Segment> previous;
+    previous.swap(segments);
+
+    std::vector<SegmentConfig> configs = get_segments();
+    segments.resize(configs.size());
+    for (int i = 0; i < (int)segments.size(); i++) {
+      Segment &segment = segments[i];
+      segment.start = configs[i].start;
+      segment.length = configs[i].length;
+      segment.reverse = configs[i].reverse;
+
+      if (!previous.empty()) {
+        const Segment &source = previous[std::min(i, (int)previous.size() - 1)];
+        segment.state_on = source.state_on;
+        segment.state_brightness = source.state_brightness;
       }
+      update_brightness_table(segment);
+    }
 
-      led::set_count(count);
+    // Pixels outside of all segments stay black, including what the old layout left on the outputs
+    std::fill(colors_target, colors_target + get_buffer_length(), color_rgbw_black);
+    std::fill(pixels_target, pixels_target + get_buffer_length(), color_rgbw_black);
+    std::fill(pixels_current, pixels_current + get_buffer_length(), color_rgbw_black);
+    if (palette_size == 0) {
+      std::fill(frame_pixels, frame_pixels + get_count(), color_rgbw_black);
+      mark_frame_dirty(0, get_count());
+    }
+  }
+
+  void set_segments(const std::vector<SegmentConfig> &configs) {
+    // Save new segments
+    config->led_segment_count = configs.size();
+    std::copy(configs.begin(), configs.end(), config->led_segments);
+    config.save();
+
+    // Start the new segments from the initial color
+    setup_segments();
+    for (Segment &segment : segments) {
+      set_color(segment, initial_color);
+    }
+
+    // Emit config
+    timer.setTimeout(emit_config, 1);
+  }
+
+  // Sanitizes the configured outputs, falling back to a single output with the legacy settings.
+  // The logical strip is as long as needed to feed every output.
+  void load_output_config() {
+    int count = config->led_output_count;
+    bool valid = count >= 1 && count <= MAX_LED_OUTPUTS;
+
+    int length = 0;
+    for (int i = 0; valid && i < count; i++) {
+      const OutputConfig &output = config->led_outputs[i];
+      valid = output.count >= 1 && (output.type == LedType::WS2812 || output.type == LedType::SK6812);
+      length = std::max(length, output.offset + output.count);
+    }
+
+    if (!valid) {
+      config->led_output_count = 0;
+      return;
+    }
+
+    config->led_count = length;
+    config->led_pin = config->led_outputs[0].pin;
+    config->led_type = config->led_outputs[0].type;
+  }
+
+  std::vector<OutputConfig> get_outputs() {
+    if (config->led_output_count == 0) {
+      return {OutputConfig{.pin = (uint8_t)config->led_pin, .type = config->led_type, .count = (uint16_t)get_count(), .offset = 0}};
+    }
+
+    return std::vector<OutputConfig>(config->led_outputs, config->led_outputs + config->led_output_count);
+  }
+
+  void set_outputs(const std::vector<OutputConfig> &configs) {
+    // Save new outputs. Segments are laid out for the old count, so fall back to a single segment.
+    config->led_output_count = configs.size();
+    std::copy(configs.begin(), configs.end(), config->led_outputs);
+    config->led_segment_count = 0;
+    load_output_config();
+    config.save();
+
+    // Clear & Setup
+    clear_outputs();
+    led::setup();
+
+    // Update nupnp
+    timer.setTimeout(nupnp::sync, 1000);
+
+    // Emit config
+    timer.setTimeout(emit_config, 1);
+  }
+
+  int get_pin() {
+    return config->led_pin;
+  }
+
+  void set_pin(uint8_t pin) {
+    // Save new pin, which is also the pin of the first output
+    config->led_pin = pin;
+    config->led_outputs[0].pin = pin;
+    config.save();
+
+    // Clear & Setup
+    clear_outputs();
+    led::setup();
+
+    // Emit config
+    timer.setTimeout(emit_config, 1);
+  }
+
+  String get_type() {
+    if (config->led_type == LedType::SK6812) {
+      return "SK6812";
+    } else if (config->led_type == LedType::WS2812) {
+      return "WS2812";
+    } else {
+      return "unknown";
+    }
+  }
+
+  bool set_type(String type) {
+    if (type.equals("SK6812")) {
+      // Save
+      config->led_type = config->led_outputs[0].type = LedType::SK6812;
+      config.save();
+
+      // Clear & Setup
+      clear_outputs();
+      led::setup();
+
+      return true;
+    } else if (type.equals("WS2812")) {
+      // Save
+      config->led_type = config->led_outputs[0].type = LedType::WS2812;
+      config.save();
+
+      // Clear & Setup
+      clear_outputs();
+      led::setup();
+
+      return true;
+    } else {
+      return false;
+    }
+
+    // Emit config
+    timer.setTimeout(emit_config, 1);
+  }
+
+  void get_state(Segment &segment, JsonObject result) {
+    result["on"] = segment.state_on;
+    result["brightness"] = segment.state_brightness;
+
+    if (segment.effect != NULL) {
+      JsonObject animation = result["animation"].to<JsonObject>();
+      animation["name"] = segment.effect->name;
+      animation["speed"] = segment.effect_params.speed;
+      animation["density"] = segment.effect_params.density;
+      animation["color"]["r"] = segment.effect_params.color.r;
+      animation["color"]["g"] = segment.effect_params.color.g;
+      animation["color"]["b"] = segment.effect_params.color.b;
+      animation["color"]["w"] = segment.effect_params.color.w;
+    }
+
+    JsonArray colors = result["colors"].to<JsonArray>();
+    for (int i = 0; i < segment.state_colors.size(); i++) {
+      JsonObject pixel = colors.add<JsonObject>();
+      pixel["r"] = segment.state_colors[i].r;
+      pixel["g"] = segment.state_colors[i].g;
+      pixel["b"] = segment.state_colors[i].b;
+      pixel["w"] = segment.state_colors[i].w;
+    }
+  }
+
+  JsonDocument get_state() {
+    JsonDocument result;
+
+    // The first segment is also reported at the top level
+    get_state(segments[0], result.to<JsonObject>());
+
+    if (palette_size > 0) {
+      result["palette_speed"] = palette_speed;
+    }
+
+    if (lua_running) {
+      JsonObject lua = result["lua"].to<JsonObject>();
+      lua["segment"] = lua_segment;
+      lua["memory"] = lua_memory.used;
+      lua["memory_peak"] = lua_memory.peak;
+      lua["memory_limit"] = lua_memory.limit;
+      lua["allocations"] = lua_memory.allocations;
+      lua["allocation_failures"] = lua_memory.failures;
+    }
+
+    if (realtime_source != REALTIME_NONE) {
+      result["realtime"] = get_realtime_source_name(realtime_source);
+    }
+
+    if (segments.size() > 1) {
+      JsonArray states = result["segments"].to<JsonArray>();
+      for (Segment &segment : segments) {
+        get_state(segment, states.add<JsonObject>());
+      }
+    }
+
+    return result;
+  }
+
+  void emit_state() {
+    emit_state_pending = false;
+
+    JsonDocument state = get_state();
+    emit_event("led.state", state);
+  }
+
+  JsonDocument get_config() {
+    JsonDocument result;
+
+    result["count"] = led::get_count();
+    result["pin"] = led::get_pin();
+    result["type"] = led::get_type();
+    result["fps"] = led::get_fps();
+    result["palette_size"] = led::get_palette_size();
+
+    JsonArray outputs = result["outputs"].to<JsonArray>();
+    for (const OutputConfig &output : led::get_outputs()) {
+      JsonObject item = outputs.add<JsonObject>();
+      item["pin"] = output.pin;
+      item["type"] = output.type == LedType::SK6812 ? "SK6812" : "WS2812";
+      item["count"] = output.count;
+      item["offset"] = output.offset;
+    }
+
+    JsonArray segments = result["segments"].to<JsonArray>();
+    for (const SegmentConfig &segment : led::get_segments()) {
+      JsonObject item = segments.add<JsonObject>();
+      item["start"] = segment.start;
+      item["length"] = segment.length;
+      item["reverse"] = segment.reverse;
+    }
+
+    return result;
+  }
+
+  void emit_config() {
+    JsonDocument config = get_config();
+    ::emit_event("led.config", config);
+  }
+
+  // Allocator for the Lua state. Refusing an allocation makes Lua raise a memory error,
+  // which ends the script like any other error instead of exhausting the heap.
+  void *lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    // Without a block, osize is the type of the new object instead of a size
+    size_t old_size = ptr == NULL ? 0 : osize;
+
+    if (nsize == 0) {
+      free(ptr);
+      lua_memory.used -= old_size;
+      return NULL;
+    }
+
+    if (nsize > old_size) {
+      size_t growth = nsize - old_size;
+      if (lua_memory.used + growth > lua_memory.limit || ESP.getFreeHeap() < growth + HEAP_RESERVE / 2) {
+        lua_memory.failures++;
+        return NULL;
+      }
+    }
+
+    void *block = realloc(ptr, nsize);
+    if (block == NULL) {
+      lua_memory.failures++;
+      return NULL;
+    }
+
+    lua_memory.used = lua_memory.used - old_size + nsize;
+    lua_memory.peak = std::max(lua_memory.peak, lua_memory.used);
+    lua_memory.allocations++;
+
+    return block;
+  }
+
+  // Errors outside of a protected call end up here, right before Lua aborts
+  int lua_panic(lua_State *L) {
+    debug("# lua panic: " + String(lua_tostring(L, -1)));
+    return 0;
+  }
+
+  void lua_budget_hook(lua_State *L, lua_Debug *ar) {
+    // A script that catches the error with pcall gets no further than its next instruction
+    if (lua_call_aborted) {
+      luaL_error(L, "frame budget exceeded");
+    }
+
+    lua_call_instructions += LUA_HOOK_INSTRUCTIONS;
+
+    bool over_instructions = lua_options.instruction_budget > 0 && lua_call_instructions > lua_options.instruction_budget;
+    bool over_time = micros() - lua_call_start_us > lua_options.time_budget_us;
+    if (over_instructions || over_time) {
+      lua_call_overrun = true;
+
+      // Coroutines are preempted and continue next frame, other calls are interrupted
+      if (lua_isyieldable(L)) {
+        lua_yield(L, 0);
+        return;
+      }
+
+      // From now on the hook runs on every instruction, and raises the error again
+      lua_call_aborted = true;
+      lua_sethook(L, lua_budget_hook, LUA_MASKCOUNT, 1);
+      luaL_error(L, "frame budget exceeded");
+    }
+  }
+
+  void start_lua_call() {
+    if (lua_call_aborted) {
+      lua_sethook(lua_state, lua_budget_hook, LUA_MASKCOUNT, LUA_HOOK_INSTRUCTIONS);
+      lua_call_aborted = false;
+    }
+
+    lua_call_start_us = micros();
+    lua_call_instructions = 0;
+    lua_call_overrun = false;
+  }
+
+  void stop_lua() {
+    if (lua_running) {
+      lua_close(lua_state);
+    }
+
+    lua_running = false;
+    lua_render_ref = LUA_NOREF;
+    lua_thread = NULL;
+  }
+
+  // Maps a pixel of the script's segment into the target colors. Returns -1 when it's outside the segment.
+  int get_lua_pixel(lua_Integer pixel) {
+    const Segment &segment = segments[lua_segment];
+    if (pixel < 0 || pixel >= segment.length) {
+      return -1;
+    }
+
+    return segment.start + (segment.reverse ? segment.length - 1 - pixel : pixel);
+  }
+
+  // Resolves the optional `first` and `count` arguments at `arg` to a range [start, end) of the target colors,
+  // clamped to the script's segment
+  void get_lua_range(lua_State *L, int arg, int &start, int &end) {
+    const Segment &segment = segments[lua_segment];
+    lua_Integer first = std::max((lua_Integer)0, std::min(luaL_optinteger(L, arg, 0), (lua_Integer)segment.length));
+    lua_Integer count = std::max((lua_Integer)0, std::min(luaL_optinteger(L, arg + 1, segment.length), segment.length - first));
+
+    start = segment.reverse
+        ? segment.start + segment.length - first - count
+        : segment.start + first;
+    end = start + count;
+  }
+
+  // Colors are packed into integers as 0xWWRRGGBB in the bulk functions
+  ColorRGBW unpack_color(lua_Integer color) {
+    return ColorRGBW{
+        .r = (uint8_t)(color >> 16),
+        .g = (uint8_t)(color >> 8),
+        .b = (uint8_t)color,
+        .w = (uint8_t)(color >> 24),
+    };
+  }
+
+  // Opens the libraries and registers the bindings. Runs in protected mode,
+  // so running out of script memory here is a regular error.
+  int register_lua_bindings(lua_State *state) {
+    luaopen_base(state);
+    luaopen_math(state);
+    lua_register(state, "luxio_set_pixel_color_hsv", [](lua_State *L) {
+      int pixel = get_lua_pixel(luaL_checkinteger(L, 1));
+      uint16_t h = luaL_checkinteger(L, 2);
+      uint8_t s = luaL_checkinteger(L, 3);
+      uint8_t v = luaL_checkinteger(L, 4);
+
+      if (pixel >= 0) {
+        colors_target[pixel] = color_hsv(h, s, v);
+      }
+
+      return 0;
+    });
+    lua_register(state, "luxio_set_pixel_color_rgb", [](lua_State *L) {
+      int pixel = get_lua_pixel(luaL_checkinteger(L, 1));
+      uint8_t r = luaL_checkinteger(L, 2);
+      uint8_t g = luaL_checkinteger(L, 3);
+      uint8_t b = luaL_checkinteger(L, 4);
+
+      if (pixel >= 0) {
+        colors_target[pixel] = ColorRGBW{.r = r, .g = g, .b = b, .w = 0};
+      }
+
+      return 0;
+    });
+    lua_register(state, "luxio_set_pixel_color_rgbw", [](lua_State *L) {
+      int pixel = get_lua_pixel(luaL_checkinteger(L, 1));
+      uint8_t r = luaL_checkinteger(L, 2);
+      uint8_t g = luaL_checkinteger(L, 3);
+      uint8_t b = luaL_checkinteger(L, 4);
+      uint8_t w = luaL_checkinteger(L, 5);
+
+      if (pixel >= 0) {
+        colors_target[pixel] = ColorRGBW{.r = r, .g = g, .b = b, .w = w};
+      }
+
+      return 0;
+    });
+    lua_register(state, "luxio_color", [](lua_State *L) {
+      uint8_t r = luaL_checkinteger(L, 1);
+      uint8_t g = luaL_checkinteger(L, 2);
+      uint8_t b = luaL_checkinteger(L, 3);
+      uint8_t w = luaL_optinteger(L, 4, 0);
+
+      lua_pushinteger(L, Adafruit_NeoPixel::Color(r, g, b, w));
+      return 1;
+    });
+    lua_register(state, "luxio_fill", [](lua_State *L) {
+      ColorRGBW color = unpack_color(luaL_checkinteger(L, 1));
+      int start, end;
+      get_lua_range(L, 2, start, end);
+
+      std::fill(colors_target + start, colors_target + end, color);
+
+      return 0;
+    });
+    lua_register(state, "luxio_fill_gradient", [](lua_State *L) {
+      GradientStop stops[2] = {
+          GradientStop{.color = unpack_color(luaL_checkinteger(L, 1)), .position = 0},
+          GradientStop{.color = unpack_color(luaL_checkinteger(L, 2)), .position = 65536},
+      };
+      int start, end;
+      get_lua_range(L, 3, start, end);
+
+      fill_gradient(colors_target + start, end - start, stops, 2, false);
+      if (segments[lua_segment].reverse) {
+        std::reverse(colors_target + start, colors_target + end);
+      }
+
+      return 0;
+    });
+    lua_register(state, "luxio_blend", [](lua_State *L) {
+      // Moves the pixels towards a color by `amount` (0-255), e.g. to fade trails
+      ColorRGBW color = unpack_color(luaL_checkinteger(L, 1));
+      uint8_t amount = luaL_checkinteger(L, 2);
+      int start, end;
+      get_lua_range(L, 3, start, end);
+
+      for (int i = start; i < end; i++) {
+        colors_target[i] = blend_pixel(colors_target[i], color, amount);
+      }
+
+      return 0;
+    });
+    lua_register(state, "luxio_set_pixels", [](lua_State *L) {
+      // Sets pixels from `first` on, either from an array of packed colors
+      // or from a string with 4 bytes (r, g, b, w) per pixel
+      lua_Integer first = luaL_optinteger(L, 2, 0);
+
+      if (lua_istable(L, 1)) {
+        lua_Integer length = lua_rawlen(L, 1);
+        for (lua_Integer i = 0; i < length; i++) {
+          int pixel = get_lua_pixel(first + i);
+          if (pixel < 0) {
+            break;
+          }
+
+          lua_rawgeti(L, 1, i + 1);
+          colors_target[pixel] = unpack_color(lua_tointeger(L, -1));
+          lua_pop(L, 1);
+        }
+      } else if (lua_type(L, 1) == LUA_TSTRING) {
+        size_t length;
+        const uint8_t *data = (const uint8_t *)lua_tolstring(L, 1, &length);
+        for (lua_Integer i = 0; i < (lua_Integer)(length / 4); i++) {
+          int pixel = get_lua_pixel(first + i);
+          if (pixel < 0) {
+            break;
+          }
+
+          const uint8_t *color = data + i * 4;
+          colors_target[pixel] = ColorRGBW{.r = color[0], .g = color[1], .b = color[2], .w = color[3]};
+        }
+      } else {
+        return luaL_argerror(L, 1, "table or string expected");
+      }
+
+      return 0;
+    });
+    lua_register(state, "luxio_shift", [](lua_State *L) {
+      // Moves all pixels by `n` towards the end of the segment. They wrap around when `wrap` is true,
+      // otherwise the pixels shifted in are black.
+      const Segment &segment = segments[lua_segment];
+      lua_Integer n = luaL_checkinteger(L, 1);
+      bool wrap = lua_toboolean(L, 2);
+      if (segment.length == 0) {
+        return 0;
+      }
+
+      if (segment.reverse) {
+        n = -n;
+      }
+
+      ColorRGBW *first = colors_target + segment.start;
+      ColorRGBW *last = first + segment.length;
+      int steps = std::min((lua_Integer)segment.length, n < 0 ? -n : n);
+
+      if (wrap) {
+        int offset = ((n % segment.length) + segment.length) % segment.length;
+        std::rotate(first, last - offset, last);
+      } else if (n > 0) {
+        std::copy_backward(first, last - steps, last);
+        std::fill(first, first + steps, color_rgbw_black);
+      } else {
+        std::copy(first + steps, last, first);
+        std::fill(last - steps, last, color_rgbw_black);
+      }
+
+      return 0;
+    });
+    lua_register(state, "luxio_wait_frames", [](lua_State *L) -> int {
+      // Suspends main for `n` frames, 1 by default
+      lua_Integer frames = luaL_optinteger(L, 1, 1);
+      if (!lua_isyieldable(L)) {
+        return luaL_error(L, "luxio_wait_frames can only be called from main");
+      }
+
+      lua_wait_frames = std::max((lua_Integer)1, frames) - 1;
+      return lua_yield(L, 0);
+    });
+    lua_register(state, "luxio_sleep", [](lua_State *L) -> int {
+      // Suspends main for at least `ms` milliseconds
+      lua_Integer ms = luaL_checkinteger(L, 1);
+      if (!lua_isyieldable(L)) {
+        return luaL_error(L, "luxio_sleep can only be called from main");
+      }
+
+      lua_wake_ms = millis() + std::max((lua_Integer)0, ms);
+      return lua_yield(L, 0);
+    });
+    lua_register(state, "luxio_get_pixel_count", [](lua_State *L) {
+      lua_pushinteger(L, segments[lua_segment].length);
+      return 1;
+    });
+    lua_register(state, "luxio_show", [](lua_State *L) {
+      // The script's colors are taken over once at the end of the frame
+      lua_show_requested = true;
+      return 0;
+    });
+    lua_register(state, "luxio_done", [](lua_State *L) {
+      // The state can't be closed while the script is running, so stop after this frame
+      lua_stop_requested = true;
+      return 0;
+    });
+    lua_register(state, "millis", [](lua_State *L) -> int {
+      lua_pushnumber(L, (lua_Number)millis());
+      return 1;
+    });
+    lua_register(state, "print", [](lua_State *L) -> int {
+      String message = luaL_checkstring(L, 1);
+      debug("lua: " + message);
+      return 0;
+    });
+
+    return 0;
+  }
+
+  String get_script_path(const String &hash) {
+    return String(SCRIPTS_DIR) + "/" + hash;
+  }
+
+  // A 64-bit FNV-1a digest of the script followed by its length, so a cached script
+  // is only ever reused for the exact upload it was saved from
+  String hash_script(const uint8_t *data, size_t length) {
+    uint64_t digest = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+      digest = (digest ^ data[i]) * 1099511628211ULL;
+    }
+
+    char hash[SCRIPT_HASH_LENGTH + 1];
+    snprintf(hash, sizeof(hash), "%08x%08x%08x", (uint32_t)(digest >> 32), (uint32_t)digest, (uint32_t)length);
+    return String(hash);
+  }
+
+  bool is_script_hash(const String &hash) {
+    if (hash.length() != SCRIPT_HASH_LENGTH) {
+      return false;
+    }
+
+    for (unsigned int i = 0; i < hash.length(); i++) {
+      if (!isxdigit(hash[i])) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Lua 5.3 bytecode header, as written by lua_dump. See lundump.h.
+  const uint8_t LUAC_VERSION = 0x53;
+  const uint8_t LUAC_FORMAT = 0;
+  const char LUAC_DATA[] = "\x19\x93\r\n\x1a\n";
+  const lua_Integer LUAC_INT = 0x5678;
+  const lua_Number LUAC_NUM = 370.5;
+
+  // Whether bytecode was compiled for the firmware's Lua build, down to its type sizes and byte order.
+  // Lua doesn't verify the code that follows, so this can't catch crafted bytecode.
+  bool is_compatible_bytecode(const uint8_t *data, size_t length) {
+    std::vector<uint8_t> header(LUA_SIGNATURE, LUA_SIGNATURE + 4);
+    header.push_back(LUAC_VERSION);
+    header.push_back(LUAC_FORMAT);
+    header.insert(header.end(), LUAC_DATA, LUAC_DATA + 6);
+    header.push_back(sizeof(int));
+    header.push_back(sizeof(size_t));
+    header.push_back(sizeof(uint32_t));  // Instruction
+    header.push_back(sizeof(lua_Integer));
+    header.push_back(sizeof(lua_Number));
+    header.insert(header.end(), (const uint8_t *)&LUAC_INT, (const uint8_t *)&LUAC_INT + sizeof(LUAC_INT));
+    header.insert(header.end(), (const uint8_t *)&LUAC_NUM, (const uint8_t *)&LUAC_NUM + sizeof(LUAC_NUM));
+
+    return length >= header.size() && memcmp(data, header.data(), header.size()) == 0;
+  }
+
+  bool has_script(const String &hash) {
+    return LittleFS.exists(get_script_path(hash));
+  }
+
+  bool save_script(const String &hash, const uint8_t *data, size_t length) {
+    LittleFS.mkdir(SCRIPTS_DIR);
+
+    File file = LittleFS.open(get_script_path(hash), "w");
+    if (!file) {
+      return false;
+    }
+
+    bool written = file.write(data, length) == length;
+    file.close();
+
+    // Don't keep partial scripts around when the filesystem is full
+    if (!written) {
+      LittleFS.remove(get_script_path(hash));
+    }
+
+    return written;
+  }
+
+  bool delete_script(const String &hash) {
+    if (!LittleFS.remove(get_script_path(hash))) {
+      return false;
+    }
+
+    if (hash.equals(config->lua_autostart)) {
+      config->lua_autostart[0] = '\0';
+      config.save();
+    }
+
+    return true;
+  }
+
+  JsonDocument list_scripts() {
+    JsonDocument result;
+    JsonArray scripts = result.to<JsonArray>();
+
+    File dir = LittleFS.open(SCRIPTS_DIR, "r");
+    if (!dir) {
+      return result;
+    }
+
+    for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+      String hash = file.name();
+
+      JsonObject script = scripts.add<JsonObject>();
+      script["hash"] = hash;
+      script["size"] = file.size();
+      script["compiled"] = file.peek() == LUA_SIGNATURE[0];
+      script["autostart"] = hash.equals(config->lua_autostart);
+    }
+
+    return result;
+  }
+
+  // Removes cached files that aren't named by a script hash, like scripts saved under an older key format
+  void clean_scripts() {
+    std::vector<String> stale;
+
+    File dir = LittleFS.open(SCRIPTS_DIR, "r");
+    if (!dir) {
+      return;
+    }
+
+    for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+      if (!is_script_hash(file.name())) {
+        stale.push_back(file.name());
+      }
+    }
+    dir.close();
+
+    for (const String &name : stale) {
+      debug("Removing stale script " + name);
+      LittleFS.remove(get_script_path(name));
+    }
+  }
+
+  void set_autostart_script(const String &hash, const LuaOptions &options) {
+    strncpy(config->lua_autostart, hash.c_str(), sizeof(Config::lua_autostart) - 1);
+    config->lua_autostart_options = options;
+    config.save();
+  }
+
+  void clear_autostart_script() {
+    config->lua_autostart[0] = '\0';
+    config.save();
+  }
+
+  struct LuaFileReader {
+    File file;
+    char buffer[128];
+  };
+
+  const char *read_lua_file(lua_State *L, void *data, size_t *size) {
+    LuaFileReader *reader = (LuaFileReader *)data;
+    *size = reader->file.read((uint8_t *)reader->buffer, sizeof(reader->buffer));
+    return reader->buffer;
+  }
+
+  int write_lua_file(lua_State *L, const void *data, size_t size, void *file) {
+    return ((File *)file)->write((const uint8_t *)data, size) == size ? 0 : 1;
+  }
+
+  // Replaces a cached source script by the bytecode of the chunk on top of the stack
+  void compile_script(const String &hash) {
+    File file = LittleFS.open(SCRIPT_TEMP_PATH, "w");
+    if (!file) {
+      return;
+    }
+
+    // Debug info is kept, so errors still have line numbers
+    bool written = lua_dump(lua_state, write_lua_file, &file, 0) == 0;
+    file.close();
+
+    if (written) {
+      LittleFS.remove(get_script_path(hash));
+      LittleFS.rename(SCRIPT_TEMP_PATH, get_script_path(hash));
+    } else {
+      LittleFS.remove(SCRIPT_TEMP_PATH);
+    }
+  }
+
+  // Runs the loaded chunk once and keeps the function to call every frame. Runs in protected mode.
+  int prepare_lua_script(lua_State *L) {
+    lua_pushvalue(L, 1);
+    lua_call(L, 0, 0);
+
+    // Scripts with `main` run it as a coroutine. The thread is anchored in the registry.
+    lua_getglobal(L, "main");
+    if (lua_isfunction(L, -1)) {
+      // Only kept once anchored, luaL_ref can fail under the memory limit
+      lua_State *thread = lua_newthread(L);
+      luaL_ref(L, LUA_REGISTRYINDEX);
+      lua_xmove(L, thread, 1);
+      lua_thread = thread;
+      return 0;
+    }
+    lua_pop(L, 1);
+
+    // Scripts without `render` are re-run as a whole every frame
+    lua_getglobal(L, "render");
+    if (!lua_isfunction(L, -1)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, 1);
+    }
+    lua_render_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return 0;
+  }
+
+  void start_lua(const String &hash, LuaOptions options) {
+    // Starts run on a timer, so the segments or the palette mode may have changed since the request
+    if (palette_size > 0 || options.segment < 0 || options.segment >= (int)segments.size()) {
+      debug("# lua start cancelled, the segments changed");
+      return;
+    }
+
+    lua_options = options;
+    lua_segment = options.segment;
+    stop_effect(segments[lua_segment]);
+
+    lua_memory = LuaMemory();
+    lua_memory.limit = options.memory_limit;
+    lua_state = lua_newstate(lua_alloc, NULL);
+    if (lua_state == NULL) {
+      debug("# lua out of memory");
+      return;
+    }
+    lua_atpanic(lua_state, lua_panic);
+    lua_gc(lua_state, LUA_GCSTOP, 0);
+    lua_gc_collecting = false;
+    lua_gc_threshold = LUA_GC_MIN_THRESHOLD;
+    lua_gc_live = 0;
+    lua_sethook(lua_state, lua_budget_hook, LUA_MASKCOUNT, LUA_HOOK_INSTRUCTIONS);
+
+    lua_pushcfunction(lua_state, register_lua_bindings);
+    if (lua_pcall(lua_state, 0, 0, 0) != 0) {
+      debug("# lua setup error:\n" + String(lua_tostring(lua_state, -1)));
+      lua_close(lua_state);
+      return;
+    }
+
+    // Load the script and run it once, so it can set up its globals and define `render(t, dt)`
+    lua_show_requested = false;
+    lua_stop_requested = false;
+
+    LuaFileReader reader;
+    reader.file = LittleFS.open(get_script_path(hash), "r");
+    if (!reader.file) {
+      debug("# lua script not found: " + hash);
+      lua_close(lua_state);
+      return;
+    }
+
+    bool compiled = reader.file.peek() == LUA_SIGNATURE[0];
+    int status = lua_load(lua_state, read_lua_file, &reader, "line", NULL);
+    reader.file.close();
+
+    if (status != 0) {
+      debug("# lua load error:\n" + String(lua_tostring(lua_state, -1)));
+      lua_close(lua_state);
+      return;
+    }
+
+    // The next start of this script skips the compiler
+    if (!compiled) {
+      compile_script(hash);
+    }
+
+    lua_pushcfunction(lua_state, prepare_lua_script);
+    lua_insert(lua_state, -2);
+    start_lua_call();
+    if (lua_pcall(lua_state, 1, 0, 0) != 0) {
+      debug("# lua run error:\n" + String(lua_tostring(lua_state, -1)));
+      lua_close(lua_state);
+      lua_thread = NULL;
+      return;
+    }
+
+    // The render function is called every frame by the frame scheduler
+    lua_stats = LuaStats();
+    lua_throttle_frames = lua_skip_frames = 0;
+    lua_wait_frames = 0;
+    lua_start_ms = lua_previous_ms = lua_wake_ms = millis();
+    lua_running = true;
+
+    // Scripts draw into the target colors of their segment, so they get the segment's
+    // brightness and on state, and crossfade in from the previous state
+    Segment &target = segments[lua_segment];
+    target.state_on = true;
+    target.state_colors.clear();
+    animate(target);
+  }
+
+  void start_autostart_script() {
+    clean_scripts();
+
+    config->lua_autostart[sizeof(Config::lua_autostart) - 1] = '\0';
+    if (config->lua_autostart[0] == '\0' || palette_size > 0) {
+      return;
+    }
+
+    String hash = config->lua_autostart;
+    if (!has_script(hash)) {
+      debug("Autostart script " + hash + " is missing");
+      return;
+    }
+
+    // The segments may have changed since the script was set to autostart
+    LuaOptions options = config->lua_autostart_options;
+    if (options.segment < 0 || options.segment >= (int)segments.size()) {
+      options.segment = 0;
+    }
+
+    debug("Starting script " + hash);
+    start_lua(hash, options);
+  }
+
+  // Calls `render(t, dt)` with the time since the script started and since the previous call,
+  // in milliseconds
+  int call_lua_render() {
+    unsigned long now = millis();
+    lua_rawgeti(lua_state, LUA_REGISTRYINDEX, lua_render_ref);
+    lua_pushinteger(lua_state, now - lua_start_ms);
+    lua_pushinteger(lua_state, now - lua_previous_ms);
+    lua_previous_ms = now;
+
+    return lua_pcall(lua_state, 2, 0, 0);
+  }
+
+  // Runs the script for one frame. Returns true when the script requested a show.
+  bool lua_step() {
+    lua_show_requested = false;
+
+    // A throttled script sits out frames after overrunning its budget
+    if (lua_skip_frames > 0) {
+      lua_skip_frames--;
+      lua_stats.throttled++;
+      return false;
+    }
+
+    // A waiting coroutine is resumed once its frames or time have passed
+    if (lua_thread != NULL) {
+      if (lua_wait_frames > 0) {
+        lua_wait_frames--;
+        return false;
+      }
+
+      if ((long)(millis() - lua_wake_ms) < 0) {
+        return false;
+      }
+    }
+
+    start_lua_call();
+    int status = lua_thread != NULL
+        ? lua_resume(lua_thread, lua_state, 0)
+        : call_lua_render();
+    uint32_t time = micros() - lua_call_start_us;
+
+    // Errors are left on the stack of the thread that raised them
+    lua_State *L = lua_thread != NULL ? lua_thread : lua_state;
+
+    lua_stats.calls++;
+    lua_stats.time_us = time;
+    lua_stats.time_max_us = std::max(lua_stats.time_max_us, time);
+    lua_stats.time_total_us += time;
+
+    if (status == LUA_YIELD) {
+      if (lua_call_overrun) {
+        lua_stats.overruns++;
+
+        if (lua_options.abort_on_overrun) {
+          debug("# lua frame budget exceeded, stopping script");
+          stop_lua();
+          return false;
+        }
+      }
+
+      return lua_show_requested;
+    }
+
+    if (status != LUA_OK && lua_call_overrun) {
+      lua_pop(L, 1);
+      lua_stats.overruns++;
+
+      // An interrupted coroutine can't be resumed, only render calls are throttled
+      if (!lua_options.abort_on_overrun && lua_thread == NULL) {
+        lua_throttle_frames = std::min(std::max(lua_throttle_frames * 2, 1), 32);
+        lua_skip_frames = lua_throttle_frames;
+        return false;
+      }
+
+      debug("# lua frame budget exceeded, stopping script");
+      stop_lua();
+      return false;
+    }
+
+    if (status != LUA_OK) {
+      debug("# lua run error:\n" + String(lua_tostring(L, -1)));
+      lua_pop(L, 1);
+      lua_stats.errors++;
+      stop_lua();
+      return false;
+    }
+
+    lua_throttle_frames = 0;
+
+    // The script is done once main returns
+    if (lua_thread != NULL) {
+      lua_stop_requested = true;
+    }
+
+    if (lua_stop_requested) {
+      stop_lua();
+      animate(segments[lua_segment]);
+    }
+
+    return lua_show_requested;
+  }
+
+  // A single basic collector step, called protected so errors in `__gc` finalizers don't reach lua_panic.
+  // Returns whether the step finished a cycle. A step of N KB would only add to the allocation debt,
+  // which stays negative while the collector is stopped, so it often did no work at all.
+  int run_lua_gc_step(lua_State *L) {
+    lua_pushboolean(L, lua_gc(L, LUA_GCSTEP, 0));
+    return 1;
+  }
+
+  // Runs bounded collector steps until there is less than LUA_GC_MIN_SLACK left before `deadline_us`
+  void lua_gc_step(unsigned long deadline_us) {
+    bool near_limit = lua_memory.used >= lua_memory.limit * 3 / 4 && lua_memory.used >= lua_gc_live + lua_memory.limit / 8;
+    bool due = lua_memory.used >= lua_gc_threshold || near_limit;
+    if (!lua_gc_collecting && !due) {
+      lua_stats.gc_time_us = 0;
+      return;
+    }
+
+    unsigned long start = micros();
+    lua_gc_collecting = true;
+
+    while ((long)(deadline_us - micros()) > (long)LUA_GC_MIN_SLACK) {
+      lua_stats.gc_steps++;
+
+      // Finalizers run within the step, with the same budget as any other call
+      start_lua_call();
+      lua_pushcfunction(lua_state, run_lua_gc_step);
+      if (lua_pcall(lua_state, 0, 1, 0) != LUA_OK) {
+        debug("# lua gc error:\n" + String(lua_tostring(lua_state, -1)));
+        lua_pop(lua_state, 1);
+        lua_stats.errors++;
+        stop_lua();
+        break;
+      }
+
+      bool finished = lua_toboolean(lua_state, -1);
+      lua_pop(lua_state, 1);
+      if (finished) {
+        lua_stats.gc_cycles++;
+        lua_gc_collecting = false;
+        lua_gc_live = lua_memory.used;
+        lua_gc_threshold = std::max(lua_memory.used * 2, LUA_GC_MIN_THRESHOLD);
+        break;
+      }
+    }
+
+    uint32_t time = micros() - start;
+    lua_stats.gc_time_us = time;
+    lua_stats.gc_time_max_us = std::max(lua_stats.gc_time_max_us, time);
+  }
+
+  int get_fps() {
+    return config->led_fps;
+  }
+
+  void set_fps(int fps) {
+    // Save new fps
+    config->led_fps = fps;
+    config.save();
+
+    frame_interval_us = 1000000 / fps;
+
+    // Emit config
+    timer.setTimeout(emit_config, 1);
+  }
+
+  JsonDocument get_stats() {
+    JsonDocument result;
+
+    result["fps"] = get_fps();
+    result["frames"] = frame_stats.frames;
+    result["overruns"] = frame_stats.overruns;
+    result["dropped"] = frame_stats.dropped;
+    result["shows"] = frame_stats.shows;
+    result["shows_skipped"] = frame_stats.shows_skipped;
+    result["frame_time"] = frame_stats.frame_time_us;
+    result["frame_time_max"] = frame_stats.frame_time_max_us;
+    result["frame_time_avg"] = frame_stats.frames > 0
+        ? (uint32_t)(frame_stats.frame_time_total_us / frame_stats.frames)
+        : 0;
+    result["frame_budget"] = frame_interval_us;
+
+    JsonObject lua = result["lua"].to<JsonObject>();
+    lua["running"] = lua_running;
+    lua["calls"] = lua_stats.calls;
+    lua["errors"] = lua_stats.errors;
+    lua["time"] = lua_stats.time_us;
+    lua["time_max"] = lua_stats.time_max_us;
+    lua["time_avg"] = lua_stats.calls > 0
+        ? (uint32_t)(lua_stats.time_total_us / lua_stats.calls)
+        : 0;
+    lua["time_budget"] = lua_options.time_budget_us;
+    lua["overruns"] = lua_stats.overruns;
+    lua["throttled"] = lua_stats.throttled;
+    lua["memory"] = lua_memory.used;
+    lua["gc_steps"] = lua_stats.gc_steps;
+    lua["gc_cycles"] = lua_stats.gc_cycles;
+    lua["gc_time"] = lua_stats.gc_time_us;
+    lua["gc_time_max"] = lua_stats.gc_time_max_us;
+
+    JsonObject realtime = result["realtime"].to<JsonObject>();
+    realtime["source"] = get_realtime_source_name(realtime_source);
+    realtime["packets"] = realtime_stats.packets;
+    realtime["dropped"] = realtime_stats.dropped;
+    realtime["frames"] = realtime_stats.frames;
+    realtime["timeouts"] = realtime_stats.timeouts;
+
+    return result;
+  }
+
+  // FNV-1a over a strip buffer, one 32-bit word at a time
+  uint32_t hash_strip(const uint8_t *bytes, size_t length) {
+    uint32_t hash = 2166136261;
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+      uint32_t word;
+      memcpy(&word, bytes + i, 4);
+      hash = (hash ^ word) * 16777619;
+    }
+    for (; i < length; i++) {
+      hash = (hash ^ bytes[i]) * 16777619;
+    }
+
+    return hash;
+  }
+
+  void show() {
+    bool shown = false;
+
+    for (Output &output : outputs) {
+      // Unchanged outputs never reach the wire
+      uint32_t hash = hash_strip(output.strip->getPixels(), output.count * output.bytes_per_pixel);
+      if (output.shown_hash_valid && hash == output.shown_hash) {
+        continue;
+      }
+
+      output.strip->show();
+      output.shown_hash = hash;
+      output.shown_hash_valid = true;
+      shown = true;
+    }
+
+    if (shown) {
+      frame_stats.shows++;
+    } else {
+      frame_stats.shows_skipped++;
+    }
+  }
+
+  // Times the render pipeline on scratch buffers of `count` LEDs, without touching the strip.
+  // Results are in microseconds per frame.
+  JsonDocument benchmark(int count, int iterations) {
+    JsonDocument result;
+
+    ColorRGBW *from = (ColorRGBW *)malloc(count * 3 * sizeof(ColorRGBW));
+    // No pin, so the scratch strip never touches the live one when it's released
+    Adafruit_NeoPixel *target = new Adafruit_NeoPixel(count, -1, config->led_type == LedType::SK6812 ? NEO_GRBW + NEO_KHZ800 : NEO_GRB + NEO_KHZ800);
+    if (from == NULL || target->getPixels() == NULL) {
+      free(from);
+      delete target;
+      return result;
+    }
+    ColorRGBW *to = from + count;
+    ColorRGBW *out = from + count * 2;
+
+    for (int i = 0; i < count; i++) {
+      from[i] = ColorRGBW{.r = (uint8_t)i, .g = (uint8_t)(i * 3), .b = (uint8_t)(i * 7), .w = (uint8_t)(i * 11)};
+      to[i] = ColorRGBW{.r = (uint8_t)(i * 5), .g = (uint8_t)(i * 2), .b = 255, .w = 0};
+    }
+
+    uint32_t blend_us = 0;
+    uint32_t brightness_us = 0;
+    uint32_t output_us = 0;
+    uint32_t hash_us = 0;
+    uint32_t gradient_us = 0;
+    uint32_t gradient_hsv_us = 0;
+    uint32_t sink = 0;
+    const uint8_t *brightness_table = segments[0].brightness_table;
+
+    // Gradient with 16 evenly spaced stops
+    GradientStop stops[16];
+    for (int k = 0; k < 16; k++) {
+      stops[k] = GradientStop{
+          .color = ColorRGBW{.r = (uint8_t)(k * 97), .g = (uint8_t)(255 - k * 31), .b = (uint8_t)(k * 13), .w = 0},
+          .position = (uint32_t)k * 65536 / 15,
+      };
+    }
+
+    for (int n = 0; n < iterations; n++) {
+      unsigned long start = micros();
+      blend_pixels(out, from, to, count, (uint8_t)n);
+      blend_us += micros() - start;
+
+      start = micros();
+      for (int i = 0; i < count; i++) {
+        out[i] = ColorRGBW{
+            .r = brightness_table[out[i].r],
+            .g = brightness_table[out[i].g],
+            .b = brightness_table[out[i].b],
+            .w = brightness_table[out[i].w],
+        };
+      }
+      brightness_us += micros() - start;
+
+      start = micros();
+      write_pixels(target, out, 0, count);
+      output_us += micros() - start;
+
+      start = micros();
+      sink += hash_strip(target->getPixels(), count * (config->led_type == LedType::SK6812 ? 4 : 3));
+      hash_us += micros() - start;
+
+      start = micros();
+      fill_gradient(out, count, stops, 16, false);
+      gradient_us += micros() - start;
+
+      start = micros();
+      fill_gradient(out, count, stops, 16, true);
+      gradient_hsv_us += micros() - start;
+
+      // Keep the watchdog and Wi-Fi stack alive
+      yield();
+    }
+
+    free(from);
+    delete target;
+
+    result["count"] = count;
+    result["iterations"] = iterations;
+    result["cpu_freq"] = ESP.getCpuFreqMHz();
+    result["blend"] = (float)blend_us / iterations;
+    result["brightness"] = (float)brightness_us / iterations;
+    result["output"] = (float)output_us / iterations;
+    result["hash"] = (float)hash_us / iterations;
+    result["frame"] = (float)(blend_us + brightness_us + output_us + hash_us) / iterations;
+    result["gradient"] = (float)gradient_us / iterations;
+    result["gradient_hsv"] = (float)gradient_hsv_us / iterations;
+    result["checksum"] = sink;
+
+    return result;
+  }
+
+  /*
+   * Realtime
+   */
+
+  // Writes `count` RGB or RGBW pixels from a stream into the frame, to be shown on the
+  // next frame. A `sequence` of 0 disables the check for parts of older frames arriving late.
+  bool write_realtime(RealtimeSource source, uint8_t priority, uint16_t sequence, int offset, const uint8_t *data, int count, int bytes_per_pixel) {
+    realtime_stats.packets++;
+
+    // Palette mode has no frame. A stream keeps the strip until it times out,
+    // unless a stream with a higher priority takes over.
+    bool active = realtime_source != REALTIME_NONE;
+    bool takeover = active && source != realtime_source && priority > realtime_priority;
+    if (palette_size > 0 || (active && source != realtime_source && !takeover) || offset < 0 || offset >= get_count() || count < 1) {
+      realtime_stats.dropped++;
+      return false;
+    }
+
+    if (active && !takeover && sequence != 0 && realtime_sequence != 0 && (int16_t)(sequence - realtime_sequence) < 0) {
+      realtime_stats.dropped++;
+      return false;
+    }
+    realtime_sequence = sequence;
+    realtime_priority = priority;
+    realtime_last_ms = millis();
+
+    if (!active || takeover) {
+      realtime_source = source;
+      schedule_emit_state();
+    }
+
+    count = std::min(count, get_count() - offset);
+    ColorRGBW *out = frame_pixels + offset;
+    for (int i = 0; i < count; i++, data += bytes_per_pixel) {
+      out[i] = ColorRGBW{
+          .r = data[0],
+          .g = data[1],
+          .b = data[2],
+          .w = bytes_per_pixel == 4 ? data[3] : (uint8_t)0,
+      };
+    }
+    mark_frame_dirty(offset, offset + count);
+
+    return true;
+  }
+
+  void stop_realtime() {
+    realtime_source = REALTIME_NONE;
+    realtime_sequence = 0;
+
+    // Back to the rendered pixels
+    memcpy(frame_pixels, pixels_current, get_count() * sizeof(ColorRGBW));
+    mark_frame_dirty(0, get_count());
+
+    schedule_emit_state();
+  }
+
+  // Writes the changed range of the frame to the outputs
+  void present() {
+    write_outputs(frame_pixels, frame_dirty_start, frame_dirty_end);
+    frame_dirty_start = frame_dirty_end = 0;
+
+    show();
+  }
+
+  void render_frame() {
+    // A realtime stream replaces the rendered frame
+    if (realtime_source != REALTIME_NONE) {
+      if (millis() - realtime_last_ms < config->realtime_timeout) {
+        if (frame_dirty_start < frame_dirty_end) {
+          realtime_stats.frames++;
+          present();
+        }
+        return;
+      }
+
+      realtime_stats.timeouts++;
+      stop_realtime();
+    }
+
+    // Frames are dirty ahead of rendering when a realtime stream has just stopped
+    bool dirty = frame_dirty_start < frame_dirty_end;
+
+    // Lua renders into the target colors first, so they go through the same pipeline as effects.
+    // Like effects, scripts are paused while their segment is off.
+    bool lua_rendered = false;
+    if (lua_running) {
+      const Segment &segment = segments[lua_segment];
+      if (segment.state_on || segment.animating) {
+        lua_rendered = lua_step();
+      }
+    }
+
+    for (int i = 0; i < (int)segments.size(); i++) {
+      Segment &segment = segments[i];
+
+      // Effect or script
+      bool targets_changed = false;
+      if (segment.effect != NULL) {
+        targets_changed = effect_step(segment);
+      } else if (lua_rendered && i == lua_segment) {
+        update_targets(segment);
+        targets_changed = true;
+      }
+
+      // Transition
+      bool changed = animate_step(segment, targets_changed);
+
+      // Palette rotation
+      if (palette_size > 0) {
+        uint8_t offset = get_palette_offset();
+        if (offset != palette_offset) {
+          palette_offset = offset;
+          changed = true;
+        }
+      }
+
+      if (!changed) {
+        continue;
+      }
+      dirty = true;
+
+      // The palette is expanded straight into the outputs, it already is a consistent frame
+      if (palette_size > 0) {
+        write_palette_outputs();
+        continue;
+      }
+
+      int end = segment.start + segment.length;
+      memcpy(frame_pixels + segment.start, pixels_current + segment.start, segment.length * sizeof(ColorRGBW));
+      mark_frame_dirty(segment.start, end);
+    }
+
+    if (!dirty) {
+      return;
+    }
+
+    if (palette_size > 0) {
+      show();
+    } else {
+      present();
+    }
+  }
+
+  void setup() {
+    // Release the previous outputs
+    for (Output &output : outputs) {
+      delete output.strip;
+    }
+    outputs.clear();
+
+    load_output_config();
+    int led_count = get_count();
+
+    // Palette mode
+    if (config->led_palette_size != 0 && config->led_palette_size != 16 && config->led_palette_size != 256) {
+      config->led_palette_size = 0;
+    }
+    palette_size = config->led_palette_size;
+    palette_speed = 0;
+    palette_offset = 0;
+
+    // The frame is reallocated below, drop a realtime stream
+    realtime_source = REALTIME_NONE;
+    realtime_sequence = 0;
+
+    // Allocate pixel buffers, falling back to the default count if the heap is too small
+    if (!allocate_pixels(led_count)) {
+      debug("Could not allocate " + String(led_count) + " LEDs. Falling back to " + String(DEFAULT_LED_COUNT) + " LEDs");
+      config->led_count = led_count = DEFAULT_LED_COUNT;
+      config->led_output_count = 0;
+
+      // Without even that, run with no LEDs and keep the API and network up
+      if (!allocate_pixels(led_count)) {
+        debug("# Could not allocate " + String(led_count) + " LEDs either. Running without LEDs");
+        config->led_count = led_count = 0;
+      }
+    }
+
+    // Outputs. The white channel is only used when every output has one.
+    initial_color = color_rgbw_white;
+    white_channel = true;
+    for (const OutputConfig &output_config : get_outputs()) {
+      int led_type = output_config.type == LedType::SK6812
+          ? NEO_GRBW + NEO_KHZ800
+          : NEO_GRB + NEO_KHZ800;
+      if (output_config.type != LedType::SK6812) {
+        initial_color = color_rgb_white;
+        white_channel = false;
+      }
+
+      debug("Initializing LED strip with " + String(output_config.count) + " LEDs on pin " + String(output_config.pin) + " and type " + String(led_type));
+
+      Output output{
+          .strip = new Adafruit_NeoPixel(output_config.count, output_config.pin, led_type),
+          .offset = output_config.offset,
+          .count = output_config.count,
+          .bytes_per_pixel = (uint8_t)(output_config.type == LedType::SK6812 ? 4 : 3),
+          .shown_hash = 0,
+          .shown_hash_valid = false,
+      };
+      output.strip->begin();
+      outputs.push_back(output);
+    }
+
+    // Segments
+    load_segment_config();
+    setup_segments();
+
+    // Reset the frame clock
+    if (config->led_fps < 1 || config->led_fps > MAX_FPS) {
+      config->led_fps = DEFAULT_LED_FPS;
+    }
+    frame_interval_us = 1000000 / config->led_fps;
+    frame_next_us = micros();
+
+    if (config->realtime_timeout < MIN_REALTIME_TIMEOUT || config->realtime_timeout > MAX_REALTIME_TIMEOUT) {
+      config->realtime_timeout = DEFAULT_REALTIME_TIMEOUT;
+    }
+
+    // Make outputs black
+    clear_outputs();
+
+    // Animate to initial color
+    for (Segment &segment : segments) {
+      set_color(segment, initial_color);
+    }
+
+    // Setup LUA
+
+    // TODO: Register method `luxio_done` to stop the animation and revert to the previous state
+  }
+
+  void loop() {
+    unsigned long now = micros();
+    if ((long)(now - frame_next_us) < 0) {
+      return;
+    }
+
+    // Schedule the next frame. If whole frames were missed, drop them and resync.
+    unsigned long late = now - frame_next_us;
+    if (late >= frame_interval_us) {
+      frame_stats.dropped += late / frame_interval_us;
+      frame_next_us = now + frame_interval_us;
+    } else {
+      frame_next_us += frame_interval_us;
+    }
+
+    render_frame();
+
+    // Frame accounting
+    uint32_t frame_time = micros() - now;
+    frame_stats.frames++;
+    frame_stats.frame_time_us = frame_time;
+    frame_stats.frame_time_total_us += frame_time;
+    if (frame_time > frame_stats.frame_time_max_us) {
+      frame_stats.frame_time_max_us = frame_time;
+    }
+    if (frame_time > frame_interval_us) {
+      frame_stats.overruns++;
+    }
+
+    // Collect Lua garbage in the time left until the next frame
+    if (lua_running) {
+      lua_gc_step(frame_next_us);
+    }
+  }
+
+  namespace api {
+
+    // Resolves the optional `segment` param, which defaults to the first segment. Returns NULL when it's invalid.
+    Segment *get_segment(JsonVariant params) {
+      if (params["segment"].isNull()) {
+        return &led::segments[0];
+      }
+
+      int index = params["segment"].is<int>()
+          ? params["segment"].as<int>()
+          : -1;
+      if (index < 0 || index >= (int)led::segments.size()) {
+        return NULL;
+      }
+
+      return &led::segments[index];
+    }
+
+    APIResponse get_state(JsonVariant params) {
+      return APIResponse{
+          .result = led::get_state(),
+      };
+    }
+
+    APIResponse get_config(JsonVariant params) {
+      return APIResponse{
+          .result = led::get_config(),
+      };
+    }
+
+    APIResponse get_stats(JsonVariant params) {
+      return APIResponse{
+          .result = led::get_stats(),
+      };
+    }
+
+    APIResponse test_benchmark(JsonVariant params) {
+      int count = params["count"].is<int>()
+          ? params["count"].as<int>()
+          : led::get_count();
+      if (count < 1 || count > led::get_max_count()) {
+        return APIResponse{
+            .err = "count_out_of_range",
+        };
+      }
+
+      int iterations = params["iterations"].is<int>()
+          ? params["iterations"].as<int>()
+          : 100;
+      if (iterations < 1 || iterations > 1000) {
+        return APIResponse{
+            .err = "iterations_out_of_range",
+        };
+      }
+
+      JsonDocument result = led::benchmark(count, iterations);
+      if (result.isNull()) {
+        return APIResponse{
+            .err = "out_of_memory",
+        };
+      }
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse get_count(JsonVariant params) {
+      JsonDocument result;
+      result.set(led::get_count());
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse set_count(JsonVariant params) {
+      if (!params["count"].is<int>()) {
+        return APIResponse{
+            .err = "invalid_count",
+        };
+      }
+
+      int count = params["count"].as<int>();
+      if (count < 1 || count > led::get_max_count()) {
+        return APIResponse{
+            .err = "count_out_of_range",
+        };
+      }
+
+      // With several outputs, the count follows from their layout
+      if (config->led_output_count > 1) {
+        return APIResponse{
+            .err = "unsupported_with_multiple_outputs",
+        };
+      }
+
+      led::set_count(count);
+
+      return APIResponse{};
+    }
+
+    APIResponse get_segments(JsonVariant params) {
+      JsonDocument result;
+      result.set(led::get_config()["segments"]);
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse set_segments(JsonVariant params) {
+      // The format in params["segments"] is [{ start, length, reverse }, ...]
+
+      JsonArray items = params["segments"].as<JsonArray>();
+      if ((int)items.size() < 1 || (int)items.size() > MAX_LED_SEGMENTS) {
+        return APIResponse{
+            .err = "segments_out_of_range",
+        };
+      }
+
+      if (items.size() > 1 && led::palette_size > 0) {
+        return APIResponse{
+            .err = "unsupported_in_palette_mode",
+        };
+      }
+
+      std::vector<SegmentConfig> segments;
+      for (JsonObject item : items) {
+        if (!item["start"].is<int>() || !item["length"].is<int>()) {
+          return APIResponse{
+              .err = "invalid_segment",
+          };
+        }
+
+        int start = item["start"].as<int>();
+        int length = item["length"].as<int>();
+        if (start < 0 || length < 1 || start + length > led::get_count()) {
+          return APIResponse{
+              .err = "segment_out_of_range",
+          };
+        }
+
+        for (const SegmentConfig &other : segments) {
+          if (start < other.start + other.length && other.start < start + length) {
+            return APIResponse{
+                .err = "segments_overlap",
+            };
+          }
+        }
+
+        segments.push_back(SegmentConfig{
+            .start = (uint16_t)start,
+            .length = (uint16_t)length,
+            .reverse = item["reverse"].as<bool>(),
+        });
+      }
+
+      led::set_segments(segments);
+
+      return APIResponse{};
+    }
+
+    APIResponse get_outputs(JsonVariant params) {
+      JsonDocument result;
+      result.set(led::get_config()["outputs"]);
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse set_outputs(JsonVariant params) {
+      // The format in params["outputs"] is [{ pin, count, type, offset }, ...].
+      // Without an offset, an output continues where the previous one ended.
+
+      JsonArray items = params["outputs"].as<JsonArray>();
+      if ((int)items.size() < 1 || (int)items.size() > MAX_LED_OUTPUTS) {
+        return APIResponse{
+            .err = "outputs_out_of_range",
+        };
+      }
+
+      std::vector<OutputConfig> outputs;
+      int length = 0;
+      for (JsonObject item : items) {
+        if (!item["pin"].is<int>() || !item["count"].is<int>()) {
+          return APIResponse{
+              .err = "invalid_output",
+          };
+        }
+
+        OutputConfig output;
+
+        int pin = item["pin"].as<int>();
+        if (pin < 0 || pin > 255) {
+          return APIResponse{
+              .err = "pin_out_of_range",
+          };
+        }
+        output.pin = pin;
+
+        String type = item["type"].is<String>()
+            ? item["type"].as<String>()
+            : led::get_type();
+        if (type.equals("SK6812")) {
+          output.type = LedType::SK6812;
+        } else if (type.equals("WS2812")) {
+          output.type = LedType::WS2812;
+        } else {
+          return APIResponse{
+              .err = "invalid_type",
+          };
+        }
+
+        int count = item["count"].as<int>();
+        int offset = item["offset"].is<int>()
+            ? item["offset"].as<int>()
+            : (outputs.empty() ? 0 : outputs.back().offset + outputs.back().count);
+        if (count < 1 || offset < 0 || offset + count > UINT16_MAX) {
+          return APIResponse{
+              .err = "count_out_of_range",
+          };
+        }
+        output.count = count;
+        output.offset = offset;
+
+        length = std::max(length, offset + count);
+        outputs.push_back(output);
+      }
+
+      if (length > led::get_max_count()) {
+        return APIResponse{
+            .err = "count_out_of_range",
+        };
+      }
+
+      led::set_outputs(outputs);
+
+      return APIResponse{};
+    }
+
+    APIResponse get_fps(JsonVariant params) {
+      JsonDocument result;
+      result.set(led::get_fps());
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse set_fps(JsonVariant params) {
+      if (!params["fps"].is<int>()) {
+        return APIResponse{
+            .err = "invalid_fps",
+        };
+      }
+
+      int fps = params["fps"].as<int>();
+      if (fps < 1 || fps > MAX_FPS) {
+        return APIResponse{
+            .err = "fps_out_of_range",
+        };
+      }
+
+      led::set_fps(fps);
+
+      return APIResponse{};
+    }
+
+    APIResponse get_pin(JsonVariant params) {
+      JsonDocument result;
+      result.set(led::get_pin());
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse set_pin(JsonVariant params) {
+      if (!params["pin"].is<int>()) {
+        return APIResponse{
+            .err = "invalid_pin",
+        };
+      }
+
+      int pin = params["pin"].as<uint8_t>();
+      if (pin < 0 || pin > 255) {
+        return APIResponse{
+            .err = "pin_out_of_range",
+        };
+      }
+
+      led::set_pin(pin);
+
+      return APIResponse{};
+    }
+
+    APIResponse get_type(JsonVariant params) {
+      JsonDocument result;
+      result.set(led::get_type());
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse set_type(JsonVariant params) {
+      if (!params["type"].is<String>()) {
+        return APIResponse{
+            .err = "invalid_type",
+        };
+      }
+
+      String type = params["type"].as<String>();
+
+      if (led::set_type(type)) {
+        return APIResponse{};
+      } else {
+        return APIResponse{
+            .err = "invalid_type",
+        };
+      }
+
+      return APIResponse{};
+    }
+
+    APIResponse set_on(JsonVariant params) {
+      Segment *segment = get_segment(params);
+      if (segment == NULL) {
+        return APIResponse{
+            .err = "invalid_segment",
+        };
+      }
+
+      if (!params["on"].is<bool>()) {
+        return APIResponse{
+            .err = "missing_on",
+        };
+      }
+
+      bool on = params["on"].as<bool>();
+      led::set_on(*segment, on);
+
+      return APIResponse{};
+    }
+
+    APIResponse set_color(JsonVariant params) {
+      Segment *segment = get_segment(params);
+      if (segment == NULL) {
+        return APIResponse{
+            .err = "invalid_segment",
+        };
+      }
+
+      if (!params["r"].is<int>() || !params["g"].is<int>() || !params["b"].is<int>()) {
+        return APIResponse{
+            .err = "invalid_color",
+        };
+      }
+
+      // The format in params is { r, g, b, w }
+      ColorRGBW target_color{
+          .r = params["r"].as<uint8_t>(),
+          .g = params["g"].as<uint8_t>(),
+          .b = params["b"].as<uint8_t>(),
+          .w = params["w"].is<uint8_t>()
+              ? params["w"].as<uint8_t>()
+              : (uint8_t)0,
+      };
+
+      led::set_color(*segment, target_color);
+
+      return APIResponse{};
+    }
+
+    APIResponse set_gradient(JsonVariant params) {
+      // The format in params["colors"] is [{ r, g, b, w, position }, ...]
+
+      Segment *segment = get_segment(params);
+      if (segment == NULL) {
+        return APIResponse{
+            .err = "invalid_segment",
+        };
+      }
+
+      JsonArray colors = params["colors"].as<JsonArray>();
+      if ((int)colors.size() < 1 || (int)colors.size() > segment->length) {
+        return APIResponse{
+            .err = "colors_out_of_range",
+        };
+      }
+
+      bool hsv = false;
+      if (params["interpolation"].is<String>()) {
+        String interpolation = params["interpolation"].as<String>();
+        if (interpolation.equals("hsv")) {
+          hsv = true;
+        } else if (!interpolation.equals("rgb")) {
+          return APIResponse{
+              .err = "invalid_interpolation",
+          };
+        }
+      }
+
+      // Decode the stops once. Positions are optional, but must be given for all stops or none.
+      std::vector<GradientStop> stops;
+      stops.reserve(colors.size());
+      bool has_positions = colors[0]["position"].is<float>();
+      for (JsonObject color : colors) {
+        GradientStop stop{
+            .color = ColorRGBW{
+                .r = color["r"].as<uint8_t>(),
+                .g = color["g"].as<uint8_t>(),
+                .b = color["b"].as<uint8_t>(),
+                .w = color["w"].as<uint8_t>(),
+            },
+            .position = 0,
+        };
+
+        if (color["position"].is<float>() != has_positions) {
+          return APIResponse{
+              .err = "invalid_position",
+          };
+        }
+
+        if (has_positions) {
+          float position = color["position"].as<float>();
+          if (position < 0 || position > 1 || (stops.size() > 0 && position * 65536 < stops.back().position)) {
+            return APIResponse{
+                .err = "position_out_of_range",
+            };
+          }
+          stop.position = position * 65536;
+        } else if (colors.size() > 1) {
+          stop.position = (uint32_t)stops.size() * 65536 / (colors.size() - 1);
+        }
+
+        stops.push_back(stop);
+      }
+
+      led::set_gradient(*segment, stops, hsv);
+
+      return APIResponse{};
+    }
+
+    APIResponse set_palette(JsonVariant params) {
+      // The format in params["colors"] is [{ r, g, b, w }, ...] and in params["pixels"] [index, ...]
+
+      if (led::palette_size == 0) {
+        return APIResponse{
+            .err = "not_in_palette_mode",
+        };
+      }
+
+      JsonArray colors = params["colors"].as<JsonArray>();
+      if ((int)colors.size() < 1 || (int)colors.size() > led::palette_size) {
+        return APIResponse{
+            .err = "colors_out_of_range",
+        };
+      }
+
+      std::vector<ColorRGBW> palette;
+      palette.reserve(colors.size());
+      for (JsonObject color : colors) {
+        palette.push_back(ColorRGBW{
+            .r = color["r"].as<uint8_t>(),
+            .g = color["g"].as<uint8_t>(),
+            .b = color["b"].as<uint8_t>(),
+            .w = color["w"].as<uint8_t>(),
+        });
+      }
+
+      std::vector<uint8_t> indices;
+      if (params["pixels"].is<JsonArray>()) {
+        JsonArray pixels = params["pixels"].as<JsonArray>();
+        if ((int)pixels.size() > led::get_count()) {
+          return APIResponse{
+              .err = "pixels_out_of_range",
+          };
+        }
+
+        indices.reserve(pixels.size());
+        for (JsonVariant index : pixels) {
+          if (!index.is<int>() || index.as<int>() < 0 || index.as<int>() >= led::palette_size) {
+            return APIResponse{
+                .err = "invalid_index",
+            };
+          }
+          indices.push_back(index.as<uint8_t>());
+        }
+      }
+
+      int speed = params["speed"].is<int>()
+          ? params["speed"].as<int>()
+          : 0;
+      if (speed < -1000 || speed > 1000) {
+        return APIResponse{
+            .err = "speed_out_of_range",
+        };
+      }
+
+      led::set_palette(palette, indices, speed);
+
+      return APIResponse{};
+    }
+
+    APIResponse get_palette_size(JsonVariant params) {
+      JsonDocument result;
+      result.set(led::get_palette_size());
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse set_palette_size(JsonVariant params) {
+      if (!params["size"].is<int>()) {
+        return APIResponse{
+            .err = "invalid_size",
+        };
+      }
+
+      int size = params["size"].as<int>();
+      if (size != 0 && size != 16 && size != 256) {
+        return APIResponse{
+            .err = "invalid_size",
+        };
+      }
+
+      if (led::get_count() > led::get_max_count(size)) {
+        return APIResponse{
+            .err = "count_out_of_range",
+        };
+      }
+
+      led::set_palette_size(size);
+
+      return APIResponse{};
+    }
+
+    APIResponse set_brightness(JsonVariant params) {
+      Segment *segment = get_segment(params);
+      if (segment == NULL) {
+        return APIResponse{
+            .err = "invalid_segment",
+        };
+      }
+
+      if (!params["brightness"].is<int>()) {
+        return APIResponse{
+            .err = "invalid_brightness",
+        };
+      }
+
+      int brightness = params["brightness"].as<uint8_t>();
+      if (brightness < 10 || brightness > 255) {
+        return APIResponse{
+            .err = "brightness_out_of_range",
+        };
+      }
+
+      led::set_brightness(*segment, brightness);
+
+      return APIResponse{};
+    }
+
+    APIResponse start_lua(JsonVariant params) {
+      if (led::palette_size > 0) {
+        return APIResponse{
+            .err = "unsupported_in_palette_mode",
+        };
+      }
+
+      Segment *segment = get_segment(params);
+      if (segment == NULL) {
+        return APIResponse{
+            .err = "invalid_segment",
+        };
+      }
+
+      LuaOptions options;
+      options.segment = segment - led::segments.data();
+
+      // The memory limit defaults to DEFAULT_LUA_MEMORY_LIMIT, and can't eat into the heap reserve
+      if (params["memory_limit"].is<int>()) {
+        int limit = params["memory_limit"].as<int>();
+        if (limit < (int)LUA_MEMORY_MIN || limit > (int)ESP.getFreeHeap() - HEAP_RESERVE) {
+          return APIResponse{
+              .err = "memory_limit_out_of_range",
+          };
+        }
+        options.memory_limit = limit;
+      }
+
+      // Budget per call in microseconds
+      if (params["time_budget"].is<int>()) {
+        int budget = params["time_budget"].as<int>();
+        if (budget < 1000 || budget > 100000) {
+          return APIResponse{
+              .err = "time_budget_out_of_range",
+          };
+        }
+        options.time_budget_us = budget;
+      }
+
+      // Budget per call in VM instructions, 0 for none
+      if (params["instruction_budget"].is<int>()) {
+        int budget = params["instruction_budget"].as<int>();
+        if (budget != 0 && budget < LUA_HOOK_INSTRUCTIONS) {
+          return APIResponse{
+              .err = "instruction_budget_out_of_range",
+          };
+        }
+        options.instruction_budget = budget;
+      }
+
+      if (params["on_overrun"].is<String>()) {
+        String on_overrun = params["on_overrun"].as<String>();
+        if (on_overrun.equals("abort")) {
+          options.abort_on_overrun = true;
+        } else if (!on_overrun.equals("throttle")) {
+          return APIResponse{
+              .err = "invalid_on_overrun",
+          };
+        }
+      }
+
+      // The script is given as source, as base64 encoded bytecode, or by the hash of a cached script
+      String hash;
+      if (params["script"].is<String>()) {
+        String script = params["script"].as<String>();
+        hash = led::hash_script((const uint8_t *)script.c_str(), script.length());
+        if (!led::has_script(hash) && !led::save_script(hash, (const uint8_t *)script.c_str(), script.length())) {
+          return APIResponse{
+              .err = "storage_full",
+          };
+        }
+      } else if (params["bytecode"].is<String>()) {
+        String encoded = params["bytecode"].as<String>();
+        std::vector<char> bytecode(encoded.length() * 3 / 4 + 1);
+        int length = base64_decode_chars(encoded.c_str(), encoded.length(), bytecode.data());
+
+        // Bytecode has to match the firmware's Lua 5.3 build, including its integer and float sizes.
+        // It runs unverified, so only trusted clients should upload it.
+        if (length < 0 || !led::is_compatible_bytecode((const uint8_t *)bytecode.data(), length)) {
+          return APIResponse{
+              .err = "invalid_bytecode",
+          };
+        }
+
+        hash = led::hash_script((const uint8_t *)bytecode.data(), length);
+        if (!led::has_script(hash) && !led::save_script(hash, (const uint8_t *)bytecode.data(), length)) {
+          return APIResponse{
+              .err = "storage_full",
+          };
+        }
+      } else if (params["hash"].is<String>()) {
+        hash = params["hash"].as<String>();
+        if (!led::is_script_hash(hash)) {
+          return APIResponse{
+              .err = "invalid_hash",
+          };
+        }
+
+        if (!led::has_script(hash)) {
+          return APIResponse{
+              .err = "unknown_script",
+          };
+        }
+      } else {
+        return APIResponse{
+            .err = "missing_script",
+        };
+      }
+
+      if (params["autostart"].is<bool>()) {
+        if (params["autostart"].as<bool>()) {
+          led::set_autostart_script(hash, options);
+        } else if (hash.equals(config->lua_autostart)) {
+          led::clear_autostart_script();
+        }
+      }
+
+      timer.setTimeout([hash, options]() {
+        led::stop_lua();
+        led::start_lua(hash, options);
+      },
+          100);
+
+      JsonDocument result;
+      result["hash"] = hash;
+
+      return APIResponse{
+          .result = result,
+      };
+    }
+
+    APIResponse list_scripts(JsonVariant params) {
+      return APIResponse{
+          .result = led::list_scripts(),
+      };
+    }
+
+    APIResponse delete_script(JsonVariant params) {
+      String hash = params["hash"].as<String>();
+      if (!params["hash"].is<String>() || !led::is_script_hash(hash)) {
+        return APIResponse{
+            .err = "invalid_hash",
+        };
+      }
+
+      if (!led::delete_script(hash)) {
+        return APIResponse{
+            .err = "unknown_script",
+        };
+      }
+
+      return APIResponse{};
+    }
+
+    APIResponse stop_lua(JsonVariant params) {
+      led::stop_lua();
+
+      return APIResponse{};
+    }
+
+    APIResponse set_animation(JsonVariant params) {
+      if (led::palette_size > 0) {
+        return APIResponse{
+            .err = "unsupported_in_palette_mode",
+        };
+      }
+
+      if (!params["name"].is<String>()) {
+        return APIResponse{
+            .err = "invalid_animation",
+        };
+      }
+
+      Segment *segment = get_segment(params);
+      if (segment == NULL) {
+        return APIResponse{
+            .err = "invalid_segment",
+        };
+      }
+
+      const Effect *effect = led::find_effect(params["name"].as<String>());
+      if (effect == NULL) {
+        return APIResponse{
+            .err = "unknown_animation",
+        };
+      }
+
+      EffectParams effect_params;
+      effect_params.color = initial_color;
+
+      if (params["speed"].is<int>()) {
+        int speed = params["speed"].as<int>();
+        if (speed < 1 || speed > 255) {
+          return APIResponse{
+              .err = "speed_out_of_range",
+          };
+        }
+        effect_params.speed = speed;
+      }
+
+      if (params["density"].is<int>()) {
+        int density = params["density"].as<int>();
+        if (density < 0 || density > 255) {
+          return APIResponse{
+              .err = "density_out_of_range",
+          };
+        }
+        effect_params.density = density;
+      }
+
+      if (params["color"].is<JsonObject>()) {
+        JsonObject color = params["color"].as<JsonObject>();
+        if (!color["r"].is<int>() || !color["g"].is<int>() || !color["b"].is<int>()) {
+          return APIResponse{
+              .err = "invalid_color",
+          };
+        }
+
+        effect_params.color = ColorRGBW{
+            .r = color["r"].as<uint8_t>(),
+            .g = color["g"].as<uint8_t>(),
+            .b = color["b"].as<uint8_t>(),
+            .w = color["w"].is<uint8_t>()
+                ? color["w"].as<uint8_t>()
+                : (uint8_t)0,
+        };
+      }
+
+      led::set_animation(*segment, effect, effect_params);
+
+      return APIResponse{};
+    }
+
+  }  // namespace api
+
+}  // namespace led
+
+namespace udp {
+
+  const int DDP_PORT = 4048;
+  const int E131_PORT = 5568;
+  const int ARTNET_PORT = 6454;
+
+  // Large enough for a full DDP packet, the largest of the three
+  const int PACKET_SIZE = 1460;
+  const int MAX_PACKETS_PER_LOOP = 8;  // Per protocol, so the frames keep their pace during a flood
+
+  // Universes carry whole pixels, 170 RGB or 128 RGBW pixels in 512 channels
+  const int UNIVERSE_SIZE = 512;
+  const int MAX_UNIVERSE = 63999;
+
+  // Packets up to this far behind the last one are late and dropped,
+  // anything further back is taken as a restarted sender
+  const int SEQUENCE_WINDOW = 20;
+
+  const uint8_t E131_ID[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+  const uint8_t ARTNET_ID[8] = {'A', 'r', 't', '-', 'N', 'e', 't', 0};
+
+  WiFiUDP ddp_socket;
+  WiFiUDP e131_socket;
+  WiFiUDP artnet_socket;
+  uint8_t packet[PACKET_SIZE];
+
+  struct ProtocolStats {
+    uint32_t packets = 0;
+    uint32_t invalid = 0;       // Malformed, or for universes past the end of the strip
+    uint32_t out_of_order = 0;  // Late packets, dropped
+    uint32_t lost = 0;          // Gaps in the sequence numbers
+    uint32_t packet_rate = 0;   // Packets in the last second
+    uint32_t packets_previous = 0;
+  };
+  ProtocolStats ddp_stats;
+  ProtocolStats e131_stats;
+  ProtocolStats artnet_stats;
+
+  // Frames shown from any realtime stream in the last second
+  uint32_t frame_rate = 0;
+  uint32_t frames_previous = 0;
+  unsigned long rate_start_ms = 0;
+
+  // Last sequence number per stream or universe, -1 when none has been seen
+  int16_t ddp_sequence = -1;
+  std::vector<int16_t> e131_sequences;
+  std::vector<int16_t> artnet_sequences;
+
+  // The E1.31 sender holding the strip, by its component ID. Another sender takes over only with
+  // a higher priority, so two sources never interleave.
+  const int E131_CID_SIZE = 16;
+  uint8_t e131_cid[E131_CID_SIZE];
+  uint8_t e131_priority = 0;
+
+  void emit_config();
+
+  void debug(String message) {
+    ::debug("udp", message);
+  }
+
+  int get_universe() {
+    return config->udp_universe;
+  }
+
+  int get_timeout() {
+    return config->realtime_timeout;
+  }
+
+  int get_channels_per_pixel() {
+    return led::white_channel ? 4 : 3;
+  }
+
+  int get_universe_count() {
+    int pixels_per_universe = UNIVERSE_SIZE / get_channels_per_pixel();
+    return (led::get_count() + pixels_per_universe - 1) / pixels_per_universe;
+  }
+
+  // Sequence numbers count up modulo `modulo`. Returns false for a late packet.
+  bool check_sequence(int16_t &last, int sequence, int modulo, ProtocolStats &stats) {
+    if (last >= 0) {
+      int ahead = (sequence - last + modulo) % modulo;
+      if (ahead == 0 || modulo - ahead <= std::min(SEQUENCE_WINDOW, modulo / 4)) {
+        stats.out_of_order++;
+        return false;
+      }
+
+      if (ahead <= modulo / 2) {
+        stats.lost += ahead - 1;
+      }
+    }
+
+    last = sequence;
+    return true;
+  }
+
+  // Resolves the universe's slot in `sequences`, or -1 when it's past the end of the strip.
+  // The sequences start over with every new stream.
+  int get_universe_index(std::vector<int16_t> &sequences, RealtimeSource source, int universe) {
+    int count = get_universe_count();
+    if ((int)sequences.size() != count || led::realtime_source != source) {
+      sequences.assign(count, -1);
+    }
+
+    int index = universe - get_universe();
+    return index >= 0 && index < count
+        ? index
+        : -1;
+  }
+
+  bool write_universe(RealtimeSource source, uint8_t priority, int index, const uint8_t *data, int channels) {
+    int channels_per_pixel = get_channels_per_pixel();
+    int offset = index * (UNIVERSE_SIZE / channels_per_pixel);
+    return led::write_realtime(source, priority, 0, offset, data, channels / channels_per_pixel, channels_per_pixel);
+  }
+
+  // DDP, http://www.3waylabs.com/ddp/
+  void handle_ddp(const uint8_t *data, int len) {
+    ddp_stats.packets++;
+
+    // Version 1 data packets only, no queries or replies
+    uint8_t flags = len >= 10 ? data[0] : 0;
+    if ((flags & 0xC0) != 0x40 || (flags & 0x06) != 0) {
+      ddp_stats.invalid++;
+      return;
+    }
+
+    // Undefined, 8-bit RGB or 8-bit RGBW
+    int bytes_per_pixel = data[2] == 0x1B
+        ? 4
+        : 3;
+    if (data[2] != 0x00 && data[2] != 0x0B && data[2] != 0x1B) {
+      ddp_stats.invalid++;
+      return;
+    }
+
+    // The header grows by a timecode
+    int header = flags & 0x10
+        ? 14
+        : 10;
+    uint32_t offset = (uint32_t)data[4] << 24 | (uint32_t)data[5] << 16 | data[6] << 8 | data[7];
+    int length = std::min(data[8] << 8 | data[9], len - header);
+    if (length < 0 || offset % bytes_per_pixel != 0 || offset / bytes_per_pixel >= (uint32_t)led::get_count()) {
+      ddp_stats.invalid++;
+      return;
+    }
+
+    // Sequence numbers run from 1 to 15, 0 when the sender doesn't number its packets
+    int sequence = data[1] & 0x0F;
+    if (led::realtime_source != REALTIME_DDP) {
+      ddp_sequence = -1;
+    }
+    if (sequence != 0 && !check_sequence(ddp_sequence, sequence - 1, 15, ddp_stats)) {
+      return;
+    }
+
+    led::write_realtime(REALTIME_DDP, DEFAULT_REALTIME_PRIORITY, 0, offset / bytes_per_pixel, data + header, length / bytes_per_pixel, bytes_per_pixel);
+  }
+
+  // E1.31 (sACN) data packets, ANSI E1.31-2018
+  void handle_e131(const uint8_t *data, int len) {
+    e131_stats.packets++;
+
+    bool valid = len >= 126
+        && memcmp(data + 4, E131_ID, sizeof(E131_ID)) == 0
+        && data[21] == 0x04  // Root vector, E1.31 data
+        && data[43] == 0x02  // Framing vector, data packet
+        && data[117] == 0x02  // DMP vector, set property
+        && data[125] == 0x00;  // Start code, DMX512 levels
+    if (!valid) {
+      e131_stats.invalid++;
+      return;
+    }
+
+    const uint8_t *cid = data + 22;
+    uint8_t priority = data[108];
+    uint8_t options = data[112];
+    int universe = data[113] << 8 | data[114];
+
+    // Preview data isn't for live output
+    if (options & 0x80) {
+      return;
+    }
+
+    bool active = led::realtime_source == REALTIME_E131;
+    bool active_sender = active && memcmp(cid, e131_cid, E131_CID_SIZE) == 0;
+
+    // The source has stopped sending one of its universes. Only the sender holding the strip can end the stream.
+    if (options & 0x40) {
+      int index = universe - get_universe();
+      if (active_sender && index >= 0 && index < get_universe_count()) {
+        led::stop_realtime();
+      }
+      return;
+    }
+
+    // Another sender takes over with a higher priority, and starts its own sequences
+    if (active && !active_sender) {
+      if (priority <= e131_priority) {
+        led::realtime_stats.packets++;
+        led::realtime_stats.dropped++;
+        return;
+      }
+
+      e131_sequences.clear();
+    }
+
+    int index = get_universe_index(e131_sequences, REALTIME_E131, universe);
+    if (index < 0) {
+      e131_stats.invalid++;
+      return;
+    }
+
+    if (!check_sequence(e131_sequences[index], data[111], 256, e131_stats)) {
+      return;
+    }
+
+    // The property count includes the start code
+    int channels = std::min((data[123] << 8 | data[124]) - 1, len - 126);
+    if (write_universe(REALTIME_E131, priority, index, data + 126, channels)) {
+      memcpy(e131_cid, cid, E131_CID_SIZE);
+      e131_priority = priority;
+    }
+  }
+
+  // Art-Net ArtDmx packets
+  void handle_artnet(const uint8_t *data, int len) {
+    artnet_stats.packets++;
 
-      return APIResponse{};
+    bool valid = len >= 18
+        && memcmp(data, ARTNET_ID, sizeof(ARTNET_ID)) == 0
+        && (data[8] | data[9] << 8) == 0x5000;  // OpDmx
+    if (!valid) {
+      artnet_stats.invalid++;
+      return;
     }
 
-    APIResponse get_pin(JsonVariant params) {
-      JsonDocument result;
-      result.set(led::get_pin());
+    int universe = (data[14] | data[15] << 8) & 0x7FFF;
+    int index = get_universe_index(artnet_sequences, REALTIME_ARTNET, universe);
+    if (index < 0) {
+      artnet_stats.invalid++;
+      return;
+    }
 
-      return APIResponse{
-          .result = result,
-      };
+    // Sequence numbers run from 1 to 255, 0 when the sender doesn't number its packets
+    uint8_t sequence = data[12];
+    if (sequence != 0 && !check_sequence(artnet_sequences[index], sequence - 1, 255, artnet_stats)) {
+      return;
     }
 
-    APIResponse set_pin(JsonVariant params) {
-      if (!params["pin"].is<int>()) {
-        return APIResponse{
-            .err = "invalid_pin",
-        };
-      }
+    int channels = std::min(data[16] << 8 | data[17], len - 18);
+    write_universe(REALTIME_ARTNET, DEFAULT_REALTIME_PRIORITY, index, data + 18, channels);
+  }
 
-      int pin = params["pin"].as<uint8_t>();
-      if (pin < 0 || pin > 255) {
-        return APIResponse{
-            .err = "pin_out_of_range",
-        };
+  // Decodes the waiting packets from the receive buffer straight into the frame
+  void receive(WiFiUDP &socket, void (*handle)(const uint8_t *data, int len)) {
+    for (int i = 0; i < MAX_PACKETS_PER_LOOP; i++) {
+      int size = socket.parsePacket();
+      if (size <= 0) {
+        return;
       }
 
-      led::set_pin(pin);
-
-      return APIResponse{};
+      int len = socket.read(packet, std::min(size, PACKET_SIZE));
+      if (len > 0) {
+        handle(packet, len);
+      }
     }
+  }
 
-    APIResponse get_type(JsonVariant params) {
-      JsonDocument result;
-      result.set(led::get_type());
+  void update_rate(ProtocolStats &stats) {
+    stats.packet_rate = stats.packets - stats.packets_previous;
+    stats.packets_previous = stats.packets;
+  }
 
-      return APIResponse{
-          .result = result,
-      };
-    }
+  JsonDocument get_stats(const ProtocolStats &stats) {
+    JsonDocument result;
 
-    APIResponse set_type(JsonVariant params) {
-      if (!params["type"].is<String>()) {
-        return APIResponse{
-            .err = "invalid_type",
-        };
-      }
+    result["packets"] = stats.packets;
+    result["packet_rate"] = stats.packet_rate;
+    result["invalid"] = stats.invalid;
+    result["out_of_order"] = stats.out_of_order;
+    result["lost"] = stats.lost;
 
-      String type = params["type"].as<String>();
+    return result;
+  }
 
-      if (led::set_type(type)) {
-        return APIResponse{};
-      } else {
-        return APIResponse{
-            .err = "invalid_type",
-        };
-      }
+  JsonDocument get_state() {
+    JsonDocument result;
 
-      return APIResponse{};
-    }
+    result["realtime"] = led::get_realtime_source_name(led::realtime_source);
+    result["frame_rate"] = frame_rate;
+    result["ddp"] = get_stats(ddp_stats);
+    result["e131"] = get_stats(e131_stats);
+    result["artnet"] = get_stats(artnet_stats);
 
-    APIResponse set_on(JsonVariant params) {
-      if (!params["on"].is<bool>()) {
-        return APIResponse{
-            .err = "missing_on",
-        };
-      }
+    return result;
+  }
 
-      bool on = params["on"].as<bool>();
-      led::set_on(on);
+  JsonDocument get_config() {
+    JsonDocument result;
 
-      return APIResponse{};
-    }
+    result["universe"] = get_universe();
+    result["timeout"] = get_timeout();
+    result["ddp_port"] = DDP_PORT;
+    result["e131_port"] = E131_PORT;
+    result["artnet_port"] = ARTNET_PORT;
 
-    APIResponse set_color(JsonVariant params) {
-      if (!params["r"].is<int>() || !params["g"].is<int>() || !params["b"].is<int>()) {
-        return APIResponse{
-            .err = "invalid_color",
-        };
-      }
+    return result;
+  }
 
-      // The format in params is { r, g, b, w }
-      ColorRGBW target_color{
-          .r = params["r"].as<uint8_t>(),
-          .g = params["g"].as<uint8_t>(),
-          .b = params["b"].as<uint8_t>(),
-          .w = params["w"].is<uint8_t>()
-              ? params["w"].as<uint8_t>()
-              : (uint8_t)0,
-      };
+  void emit_config() {
+    JsonDocument config = get_config();
+    emit_event("udp.config", config);
+  }
 
-      led::set_color(target_color);
+  void set_universe(int universe) {
+    config->udp_universe = universe;
+    config.save();
 
-      return APIResponse{};
-    }
+    // Emit config
+    timer.setTimeout(emit_config, 1);
+  }
 
-    APIResponse set_gradient(JsonVariant params) {
-      // The format in params["pixels"] is [[r,g b, w], ...]
+  void set_timeout(int timeout) {
+    config->realtime_timeout = timeout;
+    config.save();
 
-      JsonArray colors = params["colors"].as<JsonArray>();
-      if ((int)colors.size() < 1 || (int)colors.size() > led::get_count()) {
-        return APIResponse{
-            .err = "colors_out_of_range",
-        };
-      }
+    // Emit config
+    timer.setTimeout(emit_config, 1);
+  }
 
-      // Set state
-      state_colors.clear();
-      for (int i = 0; i < (int)colors.size(); i++) {
-        JsonObject color = colors[i].as<JsonObject>();
-        state_colors.push_back(ColorRGBW{
-            .r = color["r"].as<uint8_t>(),
-            .g = color["g"].as<uint8_t>(),
-            .b = color["b"].as<uint8_t>(),
-            .w = color["w"].as<uint8_t>(),
-        });
-      }
+  void setup() {
+    if (config->udp_universe > MAX_UNIVERSE) {
+      config->udp_universe = DEFAULT_UDP_UNIVERSE;
+    }
 
-      // Interpolate r,g,b,w colors to create a gradient the size of the LED count
-      int numColors = colors.size();
-      for (int i = 0; i < led::get_count(); i++) {
-        float t = (float)i / (led::get_count() - 1);
-        int idx1 = floor(t * (numColors - 1));
-        int idx2 = ceil(t * (numColors - 1));
-        JsonObject color1 = colors[idx1].as<JsonObject>();
-        uint8_t color1_r = color1["r"].as<uint8_t>();
-        uint8_t color1_g = color1["g"].as<uint8_t>();
-        uint8_t color1_b = color1["b"].as<uint8_t>();
-        uint8_t color1_w = color1["w"].as<uint8_t>();
+    ddp_socket.begin(DDP_PORT);
+    e131_socket.begin(E131_PORT);
+    artnet_socket.begin(ARTNET_PORT);
 
-        JsonObject color2 = colors[idx2].as<JsonObject>();
-        uint8_t color2_r = color2["r"].as<uint8_t>();
-        uint8_t color2_g = color2["g"].as<uint8_t>();
-        uint8_t color2_b = color2["b"].as<uint8_t>();
-        uint8_t color2_w = color2["w"].as<uint8_t>();
+    debug("Listening for DDP on " + String(DDP_PORT) + ", E1.31 on " + String(E131_PORT) + " and Art-Net on " + String(ARTNET_PORT));
+  }
 
-        ColorRGBW interpolatedColor;
-        interpolatedColor.r = color1_r + (color2_r - color1_r) * (t * (numColors - 1) - idx1);
-        interpolatedColor.g = color1_g + (color2_g - color1_g) * (t * (numColors - 1) - idx1);
-        interpolatedColor.b = color1_b + (color2_b - color1_b) * (t * (numColors - 1) - idx1);
-        interpolatedColor.w = color1_w + (color2_w - color1_w) * (t * (numColors - 1) - idx1);
+  void loop() {
+    receive(ddp_socket, handle_ddp);
+    receive(e131_socket, handle_e131);
+    receive(artnet_socket, handle_artnet);
+
+    // Rates over the last second
+    if (millis() - rate_start_ms >= 1000) {
+      rate_start_ms = millis();
+      update_rate(ddp_stats);
+      update_rate(e131_stats);
+      update_rate(artnet_stats);
+      frame_rate = led::realtime_stats.frames - frames_previous;
+      frames_previous = led::realtime_stats.frames;
+    }
+  }
 
-        colors_target[i] = interpolatedColor;
-      }
+  namespace api {
 
-      led::set_gradient();  // TODO: Pass new colors
+    APIResponse get_config(JsonVariant params) {
+      return APIResponse{
+          .result = udp::get_config(),
+      };
+    }
 
-      return APIResponse{};
+    APIResponse get_state(JsonVariant params) {
+      return APIResponse{
+          .result = udp::get_state(),
+      };
     }
 
-    APIResponse set_brightness(JsonVariant params) {
-      if (!params["brightness"].is<int>()) {
+    APIResponse set_universe(JsonVariant params) {
+      if (!params["universe"].is<int>()) {
         return APIResponse{
-            .err = "invalid_brightness",
+            .err = "invalid_universe",
         };
       }
 
-      int brightness = params["brightness"].as<uint8_t>();
-      if (brightness < 10 || brightness > 255) {
+      int universe = params["universe"].as<int>();
+      if (universe < 0 || universe > MAX_UNIVERSE) {
         return APIResponse{
-            .err = "brightness_out_of_range",
+            .err = "universe_out_of_range",
         };
       }
 
-      led::set_brightness(brightness);
+      udp::set_universe(universe);
 
       return APIResponse{};
     }
 
-    APIResponse start_lua(JsonVariant params) {
-      if (!params["script"].is<String>()) {
+    APIResponse set_timeout(JsonVariant params) {
+      if (!params["timeout"].is<int>()) {
         return APIResponse{
-            .err = "missing_script",
+            .err = "invalid_timeout",
         };
       }
 
-      String script = params["script"].as<String>();
-      timer.setTimeout([script]() {
-        led::stop_lua();
-        led::start_lua(script);
-      },
-          100);
-
-      return APIResponse{};
-    }
+      int timeout = params["timeout"].as<int>();
+      if (timeout < led::MIN_REALTIME_TIMEOUT || timeout > led::MAX_REALTIME_TIMEOUT) {
+        return APIResponse{
+            .err = "timeout_out_of_range",
+        };
+      }
 
-    APIResponse stop_lua(JsonVariant params) {
-      led::stop_lua();
+      udp::set_timeout(timeout);
 
       return APIResponse{};
     }
 
-    APIResponse set_animation(JsonVariant params) {
-      // TODO
-
-      return APIResponse{
-          .err = "not_implemented",
-      };
-    }
-
   }  // namespace api
 
-}  // namespace led
+}  // namespace udp
 
 namespace mdns {
 
@@ -1675,94 +5120,245 @@ namespace ota {
 
 }  // namespace ota
 
-JsonDocument handle_request(const int req_id, const String method, const JsonVariant params) {
-  // Debug
-  debug("req:" + String(req_id), method);
+/*
+ * Methods
+ */
 
-  // Assign the correct method
+enum MethodFlags : uint8_t {
+  METHOD_MUTATES = 1 << 0,     // Changes state or config
+  METHOD_ASYNC_SAFE = 1 << 1,  // Short and read-only, can run from a network callback
+};
+
+struct Method {
+  uint32_t hash;
+  const char *name;
   APIResponse (*fn)(JsonVariant params);
-  if (false) {
-    // Only for code alignment
-  } else if (method.equals("wifi.get_config")) {
-    fn = &wifi::api::get_config;
-  } else if (method.equals("wifi.get_state")) {
-    fn = &wifi::api::get_state;
-  } else if (method.equals("wifi.get_networks")) {
-    fn = &wifi::api::get_networks;
-  } else if (method.equals("wifi.scan_networks")) {
-    fn = &wifi::api::scan_networks;
-  } else if (method.equals("wifi.connect")) {
-    fn = &wifi::api::connect;
-  } else if (method.equals("wifi.disconnect")) {
-    fn = &wifi::api::disconnect;
-  } else if (method.equals("led.get_config")) {
-    fn = &led::api::get_config;
-  } else if (method.equals("led.get_state")) {
-    fn = &led::api::get_state;
-  } else if (method.equals("led.get_count")) {
-    fn = &led::api::get_count;
-  } else if (method.equals("led.set_count")) {
-    fn = &led::api::set_count;
-  } else if (method.equals("led.get_pin")) {
-    fn = &led::api::get_pin;
-  } else if (method.equals("led.set_pin")) {
-    fn = &led::api::set_pin;
-  } else if (method.equals("led.get_type")) {
-    fn = &led::api::get_type;
-  } else if (method.equals("led.set_type")) {
-    fn = &led::api::set_type;
-  } else if (method.equals("led.set_on")) {
-    fn = &led::api::set_on;
-  } else if (method.equals("led.set_color")) {
-    fn = &led::api::set_color;
-  } else if (method.equals("led.set_gradient")) {
-    fn = &led::api::set_gradient;
-  } else if (method.equals("led.set_brightness")) {
-    fn = &led::api::set_brightness;
-  } else if (method.equals("led.set_animation")) {
-    fn = &led::api::set_animation;
-  } else if (method.equals("led.start_lua")) {
-    fn = &led::api::start_lua;
-  } else if (method.equals("led.stop_lua")) {
-    fn = &led::api::stop_lua;
-  } else if (method.equals("system.ping")) {
-    fn = &sys::api::ping;
-  } else if (method.equals("system.test_error")) {
-    fn = &sys::api::test_error;
-  } else if (method.equals("system.test_echo")) {
-    fn = &sys::api::test_echo;
-  } else if (method.equals("system.get_config")) {
-    fn = &sys::api::get_config;
-  } else if (method.equals("system.get_state")) {
-    fn = &sys::api::get_state;
-  } else if (method.equals("system.get_name")) {
-    fn = &sys::api::get_name;
-  } else if (method.equals("system.set_name")) {
-    fn = &sys::api::set_name;
-  } else if (method.equals("system.restart")) {
-    fn = &sys::api::restart;
-  } else if (method.equals("system.factory_reset")) {
-    fn = &sys::api::factory_reset;
-  } else if (method.equals("system.enable_debug")) {
-    fn = &sys::api::enable_debug;
-  } else if (method.equals("system.disable_debug")) {
-    fn = &sys::api::disable_debug;
-  } else if (method.equals("get_full_state")) {
-    fn = [](JsonVariant params) {
-      return APIResponse{
-          .result = get_full_state(),
-      };
-    };
-  } else {
-    fn = [](JsonVariant params) {
-      return APIResponse{
-          .err = "unknown_method",
-      };
+  uint8_t flags;
+};
+
+// FNV-1a, usable at compile time to build the method table
+constexpr uint32_t hash_method(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (uint8_t)*name) * 16777619u;
+  }
+  return hash;
+}
+
+constexpr Method method(const char *name, APIResponse (*fn)(JsonVariant params), uint8_t flags) {
+  return Method{
+      .hash = hash_method(name),
+      .name = name,
+      .fn = fn,
+      .flags = flags,
+  };
+}
+
+APIResponse get_full_state_method(JsonVariant params) {
+  return APIResponse{
+      .result = get_full_state(),
+  };
+}
+
+APIResponse get_methods(JsonVariant params);
+APIResponse test_dispatch_benchmark(JsonVariant params);
+
+constexpr Method methods[] = {
+    method("wifi.get_config", &wifi::api::get_config, METHOD_ASYNC_SAFE),
+    method("wifi.get_state", &wifi::api::get_state, METHOD_ASYNC_SAFE),
+    method("wifi.get_networks", &wifi::api::get_networks, METHOD_ASYNC_SAFE),
+    method("wifi.scan_networks", &wifi::api::scan_networks, METHOD_MUTATES),
+    method("wifi.connect", &wifi::api::connect, METHOD_MUTATES),
+    method("wifi.disconnect", &wifi::api::disconnect, METHOD_MUTATES),
+    method("led.get_config", &led::api::get_config, METHOD_ASYNC_SAFE),
+    method("led.get_state", &led::api::get_state, METHOD_ASYNC_SAFE),
+    method("led.get_stats", &led::api::get_stats, METHOD_ASYNC_SAFE),
+    method("led.get_count", &led::api::get_count, METHOD_ASYNC_SAFE),
+    method("led.set_count", &led::api::set_count, METHOD_MUTATES),
+    method("led.get_segments", &led::api::get_segments, METHOD_ASYNC_SAFE),
+    method("led.set_segments", &led::api::set_segments, METHOD_MUTATES),
+    method("led.get_outputs", &led::api::get_outputs, METHOD_ASYNC_SAFE),
+    method("led.set_outputs", &led::api::set_outputs, METHOD_MUTATES),
+    method("led.get_fps", &led::api::get_fps, METHOD_ASYNC_SAFE),
+    method("led.set_fps", &led::api::set_fps, METHOD_MUTATES),
+    method("led.get_pin", &led::api::get_pin, METHOD_ASYNC_SAFE),
+    method("led.set_pin", &led::api::set_pin, METHOD_MUTATES),
+    method("led.get_type", &led::api::get_type, METHOD_ASYNC_SAFE),
+    method("led.set_type", &led::api::set_type, METHOD_MUTATES),
+    method("led.set_on", &led::api::set_on, METHOD_MUTATES),
+    method("led.set_color", &led::api::set_color, METHOD_MUTATES),
+    method("led.set_gradient", &led::api::set_gradient, METHOD_MUTATES),
+    method("led.set_palette", &led::api::set_palette, METHOD_MUTATES),
+    method("led.get_palette_size", &led::api::get_palette_size, METHOD_ASYNC_SAFE),
+    method("led.set_palette_size", &led::api::set_palette_size, METHOD_MUTATES),
+    method("led.set_brightness", &led::api::set_brightness, METHOD_MUTATES),
+    method("led.set_animation", &led::api::set_animation, METHOD_MUTATES),
+    method("led.test_benchmark", &led::api::test_benchmark, 0),
+    method("led.start_lua", &led::api::start_lua, METHOD_MUTATES),
+    method("led.stop_lua", &led::api::stop_lua, METHOD_MUTATES),
+    method("led.list_scripts", &led::api::list_scripts, 0),
+    method("led.delete_script", &led::api::delete_script, METHOD_MUTATES),
+    method("system.ping", &sys::api::ping, METHOD_ASYNC_SAFE),
+    method("system.test_error", &sys::api::test_error, METHOD_ASYNC_SAFE),
+    method("system.test_echo", &sys::api::test_echo, METHOD_ASYNC_SAFE),
+    method("system.test_dispatch_benchmark", &test_dispatch_benchmark, 0),
+    method("udp.get_config", &udp::api::get_config, METHOD_ASYNC_SAFE),
+    method("udp.get_state", &udp::api::get_state, METHOD_ASYNC_SAFE),
+    method("udp.set_universe", &udp::api::set_universe, METHOD_MUTATES),
+    method("udp.set_timeout", &udp::api::set_timeout, METHOD_MUTATES),
+    method("system.get_config", &sys::api::get_config, METHOD_ASYNC_SAFE),
+    method("system.get_state", &sys::api::get_state, METHOD_ASYNC_SAFE),
+    method("system.get_name", &sys::api::get_name, METHOD_ASYNC_SAFE),
+    method("system.set_name", &sys::api::set_name, METHOD_MUTATES),
+    method("system.get_methods", &get_methods, METHOD_ASYNC_SAFE),
+    method("system.restart", &sys::api::restart, METHOD_MUTATES),
+    method("system.factory_reset", &sys::api::factory_reset, METHOD_MUTATES),
+    method("system.enable_debug", &sys::api::enable_debug, METHOD_MUTATES),
+    method("system.disable_debug", &sys::api::disable_debug, METHOD_MUTATES),
+    method("get_full_state", &get_full_state_method, METHOD_ASYNC_SAFE),
+};
+
+constexpr size_t METHOD_COUNT = sizeof(methods) / sizeof(methods[0]);
+constexpr size_t METHOD_SLOTS = 128;  // Power of two, at least twice METHOD_COUNT
+constexpr uint8_t METHOD_SLOT_EMPTY = 0xFF;
+
+static_assert(METHOD_COUNT * 2 <= METHOD_SLOTS, "METHOD_SLOTS too small");
+
+struct MethodTable {
+  uint8_t slots[METHOD_SLOTS];
+};
+
+// Open addressing with linear probing, filled at compile time
+constexpr MethodTable build_method_table() {
+  MethodTable table = {};
+  for (size_t slot = 0; slot < METHOD_SLOTS; slot++) {
+    table.slots[slot] = METHOD_SLOT_EMPTY;
+  }
+
+  for (size_t i = 0; i < METHOD_COUNT; i++) {
+    size_t slot = methods[i].hash & (METHOD_SLOTS - 1);
+    while (table.slots[slot] != METHOD_SLOT_EMPTY) {
+      slot = (slot + 1) & (METHOD_SLOTS - 1);
+    }
+    table.slots[slot] = i;
+  }
+
+  return table;
+}
+
+constexpr bool has_unique_method_hashes() {
+  for (size_t i = 0; i < METHOD_COUNT; i++) {
+    for (size_t j = i + 1; j < METHOD_COUNT; j++) {
+      if (methods[i].hash == methods[j].hash) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static_assert(has_unique_method_hashes(), "Method name hash collision");
+
+constexpr MethodTable method_table = build_method_table();
+
+const Method *find_method(const String &name) {
+  uint32_t hash = hash_method(name.c_str());
+  for (size_t slot = hash & (METHOD_SLOTS - 1);
+       method_table.slots[slot] != METHOD_SLOT_EMPTY;
+       slot = (slot + 1) & (METHOD_SLOTS - 1)) {
+    const Method *method = &methods[method_table.slots[slot]];
+    if (method->hash == hash && name.equals(method->name)) {
+      return method;
+    }
+  }
+
+  return NULL;
+}
+
+APIResponse get_methods(JsonVariant params) {
+  JsonDocument result;
+  JsonArray list = result.to<JsonArray>();
+  for (size_t i = 0; i < METHOD_COUNT; i++) {
+    JsonObject item = list.add<JsonObject>();
+    item["name"] = methods[i].name;
+    item["mutates"] = (methods[i].flags & METHOD_MUTATES) != 0;
+    item["async_safe"] = (methods[i].flags & METHOD_ASYNC_SAFE) != 0;
+  }
+
+  return APIResponse{
+      .result = result,
+  };
+}
+
+APIResponse test_dispatch_benchmark(JsonVariant params) {
+  int iterations = params["iterations"].is<int>()
+      ? params["iterations"].as<int>()
+      : 100;
+  if (iterations < 1 || iterations > 1000) {
+    return APIResponse{
+        .err = "iterations_out_of_range",
     };
   }
 
+  // Copy the names, so lookups hash a String like a real request does
+  std::vector<String> names;
+  names.reserve(METHOD_COUNT);
+  for (size_t i = 0; i < METHOD_COUNT; i++) {
+    names.push_back(methods[i].name);
+  }
+
+  // Only the lookups are timed, the Wi-Fi stack runs in between
+  size_t found = 0;
+  uint32_t hashed_us = 0;
+  uint32_t linear_us = 0;
+  for (int iteration = 0; iteration < iterations; iteration++) {
+    // Hashed lookup
+    uint32_t start = micros();
+    for (const String &name : names) {
+      found += find_method(name) != NULL;
+    }
+    hashed_us += micros() - start;
+
+    // Linear String::equals scan, the cost of the former else-if chain
+    start = micros();
+    for (const String &name : names) {
+      for (size_t i = 0; i < METHOD_COUNT; i++) {
+        if (name.equals(methods[i].name)) {
+          found++;
+          break;
+        }
+      }
+    }
+    linear_us += micros() - start;
+
+    yield();
+  }
+
+  uint32_t lookups = iterations * METHOD_COUNT;
+
+  JsonDocument result;
+  result["methods"] = METHOD_COUNT;
+  result["iterations"] = iterations;
+  result["found"] = found;
+  result["hashed_ns"] = (uint64_t)hashed_us * 1000 / lookups;
+  result["linear_ns"] = (uint64_t)linear_us * 1000 / lookups;
+
+  return APIResponse{
+      .result = result,
+  };
+}
+
+JsonDocument handle_request(const int req_id, const String method, const JsonVariant params) {
+  // Debug
+  debug("req:" + String(req_id), method);
+
   JsonDocument res;
-  APIResponse response = fn(params);
+  const Method *entry = find_method(method);
+  APIResponse response = entry != NULL
+      ? entry->fn(params)
+      : APIResponse{
+            .err = "unknown_method",
+        };
   if (response.err.length() == 0) {
     debug("req:" + String(req_id), "OK");
     res["result"] = response.result;
@@ -1774,6 +5370,75 @@ JsonDocument handle_request(const int req_id, const String method, const JsonVar
   return res;
 }
 
+// Handles an array of requests, and responds with an array of responses in the same order.
+// Mutations are applied as a single state change: one crossfade, and one state event.
+JsonDocument handle_batch(JsonArray requests) {
+  JsonDocument res;
+  if (requests.size() == 0) {
+    res["error"] = "empty_batch";
+    return res;
+  }
+
+  if (requests.size() > MAX_BATCH_REQUESTS) {
+    res["error"] = "batch_too_large";
+    return res;
+  }
+
+  JsonArray responses = res.to<JsonArray>();
+
+  led::begin_batch();
+  for (JsonVariant req : requests) {
+    if (req.is<JsonObject>()) {
+      responses.add(handle_message(req));
+    } else {
+      responses.add<JsonObject>()["error"] = "invalid_request";
+    }
+  }
+  led::end_batch();
+
+  return res;
+}
+
+// Handles a request or a batch of requests, tagging each response with the request's ID
+JsonDocument handle_message(JsonVariant req) {
+  if (req.is<JsonArray>()) {
+    return handle_batch(req.as<JsonArray>());
+  }
+
+  JsonDocument res;
+  if (req["method"].is<String>()) {
+    res = handle_request(
+        req["id"].as<int>(),
+        req["method"].as<String>(),
+        req["params"].as<JsonVariant>());
+  } else {
+    res["error"] = "invalid_method";
+  }
+
+  // Add the ID to the response
+  if (!req["id"].isNull()) {
+    res["id"] = req["id"];
+  }
+
+  return res;
+}
+
+// Whether a request or every request in a batch can run from a network callback.
+// Unknown methods are, since they only produce an error.
+bool is_async_safe(JsonVariant req) {
+  if (req.is<JsonArray>()) {
+    for (JsonVariant item : req.as<JsonArray>()) {
+      if (!is_async_safe(item)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const Method *entry = find_method(req["method"].as<String>());
+  return entry == NULL || (entry->flags & METHOD_ASYNC_SAFE) != 0;
+}
+
 void emit_event(String event, JsonDocument &data) {
   JsonDocument doc;
   doc["event"] = event;
@@ -1802,6 +5467,8 @@ JsonDocument get_full_state() {
   state["wifi"]["config"] = wifi::get_config();
   state["led"]["state"] = led::get_state();
   state["led"]["config"] = led::get_config();
+  state["udp"]["state"] = udp::get_state();
+  state["udp"]["config"] = udp::get_config();
 
   return state;
 }
@@ -1814,8 +5481,10 @@ void setup() {
   serial::setup();
   sys::setup();
   led::setup();
+  led::start_autostart_script();
   wifi::setup();
   http::setup();
+  udp::setup();
   mdns::setup();
   nupnp::setup();
   ota::setup();
@@ -1830,6 +5499,7 @@ void setup() {
 void loop() {
   serial::loop();
   sys::loop();
+  udp::loop();
   led::loop();
   mdns::loop();
   http::loop();
@@ -0,0 +1,123 @@
+// Stand-in for Adafruit_NeoPixel, for the native build.
+// Pixels are kept in the same byte order as the real library, and shows are counted.
+#pragma once
+
+#include <Arduino.h>
+
+#define NEO_RGB ((0 << 6) | (0 << 4) | (1 << 2) | (2))
+#define NEO_GRB ((1 << 6) | (1 << 4) | (0 << 2) | (2))
+#define NEO_GRBW ((3 << 6) | (1 << 4) | (0 << 2) | (2))
+#define NEO_KHZ800 0x0000
+
+typedef uint16_t neoPixelType;
+
+class Adafruit_NeoPixel {
+ public:
+  uint32_t shows = 0;
+
+  Adafruit_NeoPixel(uint16_t n, int16_t pin = 6, neoPixelType type = NEO_GRB) : pin(pin) {
+    w_offset = (type >> 6) & 0b11;
+    r_offset = (type >> 4) & 0b11;
+    g_offset = (type >> 2) & 0b11;
+    b_offset = type & 0b11;
+    bytes_per_pixel = w_offset == r_offset ? 3 : 4;
+    count = n;
+    pixels = (uint8_t *)calloc(n * bytes_per_pixel, 1);
+  }
+
+  ~Adafruit_NeoPixel() {
+    free(pixels);
+    if (pin >= 0) {
+      pinMode(pin, INPUT);
+    }
+  }
+
+  void begin() {
+    if (pin >= 0) {
+      pinMode(pin, OUTPUT);
+    }
+  }
+  void show() { shows++; }
+  void clear() { memset(pixels, 0, count * bytes_per_pixel); }
+
+  void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b) { setPixelColor(n, r, g, b, 0); }
+  void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b, uint8_t w) {
+    if (n >= count) {
+      return;
+    }
+
+    uint8_t *p = pixels + n * bytes_per_pixel;
+    p[r_offset] = r;
+    p[g_offset] = g;
+    p[b_offset] = b;
+    if (bytes_per_pixel == 4) {
+      p[w_offset] = w;
+    }
+  }
+
+  uint8_t *getPixels() const { return pixels; }
+  uint16_t numPixels() const { return count; }
+  int16_t getPin() const { return pin; }
+
+  static uint32_t Color(uint8_t r, uint8_t g, uint8_t b, uint8_t w = 0) {
+    return (uint32_t)w << 24 | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+  }
+
+  static uint8_t sine8(uint8_t x) {
+    return (uint8_t)std::lround(127.5 + 127.5 * std::sin(x * 2 * M_PI / 256));
+  }
+
+  // Same math as the library, so colors match the hardware build
+  static uint32_t ColorHSV(uint16_t hue, uint8_t sat = 255, uint8_t val = 255) {
+    uint8_t r, g, b;
+    hue = (hue * 1530L + 32768) / 65536;
+    if (hue < 510) {
+      b = 0;
+      if (hue < 255) {
+        r = 255;
+        g = hue;
+      } else {
+        r = 510 - hue;
+        g = 255;
+      }
+    } else if (hue < 1020) {
+      r = 0;
+      if (hue < 765) {
+        g = 255;
+        b = hue - 510;
+      } else {
+        g = 1020 - hue;
+        b = 255;
+      }
+    } else if (hue < 1530) {
+      g = 0;
+      if (hue < 1275) {
+        r = hue - 1020;
+        b = 255;
+      } else {
+        r = 255;
+        b = 1530 - hue;
+      }
+    } else {
+      r = 255;
+      g = b = 0;
+    }
+
+    uint32_t v1 = 1 + val;
+    uint16_t s1 = 1 + sat;
+    uint8_t s2 = 255 - sat;
+    return ((((((r * s1) >> 8) + s2) * v1) & 0xff00) << 8) |
+        (((((g * s1) >> 8) + s2) * v1) & 0xff00) |
+        (((((b * s1) >> 8) + s2) * v1) >> 8);
+  }
+
+ private:
+  int16_t pin;
+  uint16_t count;
+  uint8_t *pixels;
+  uint8_t bytes_per_pixel;
+  uint8_t r_offset;
+  uint8_t g_offset;
+  uint8_t b_offset;
+  uint8_t w_offset;
+};
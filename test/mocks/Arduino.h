@@ -0,0 +1,311 @@
+// Stand-in for the Arduino core, for the native build.
+// Time is the real clock plus an offset that tests can advance.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+typedef uint8_t byte;
+
+#define INPUT 0x00
+#define OUTPUT 0x01
+#define LOW 0x0
+#define HIGH 0x1
+
+class String {
+ public:
+  String() {}
+  String(const char *value) : value(value != NULL ? value : "") {}
+  String(const std::string &value) : value(value) {}
+  String(char c) : value(1, c) {}
+  String(int value, unsigned char base = 10) : value(format_integer(value, base)) {}
+  String(unsigned int value, unsigned char base = 10) : value(format_integer(value, base)) {}
+  String(long value, unsigned char base = 10) : value(format_integer(value, base)) {}
+  String(unsigned long value, unsigned char base = 10) : value(format_integer(value, base)) {}
+  String(long long value, unsigned char base = 10) : value(format_integer(value, base)) {}
+  String(unsigned long long value, unsigned char base = 10) : value(format_integer(value, base)) {}
+  String(float value, unsigned char decimals = 2) : String((double)value, decimals) {}
+  String(double value, unsigned char decimals = 2) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    this->value = buffer;
+  }
+
+  String &operator=(const char *value) {
+    this->value = value != NULL ? value : "";
+    return *this;
+  }
+
+  unsigned int length() const { return value.size(); }
+  const char *c_str() const { return value.c_str(); }
+  bool isEmpty() const { return value.empty(); }
+  bool reserve(unsigned int size) {
+    value.reserve(size);
+    return true;
+  }
+
+  bool concat(const String &other) {
+    value += other.value;
+    return true;
+  }
+  bool concat(const char *other) {
+    value += other != NULL ? other : "";
+    return true;
+  }
+  bool concat(const char *other, unsigned int length) {
+    value.append(other, length);
+    return true;
+  }
+  bool concat(char c) {
+    value += c;
+    return true;
+  }
+
+  String &operator+=(const String &other) {
+    concat(other);
+    return *this;
+  }
+  String &operator+=(const char *other) {
+    concat(other);
+    return *this;
+  }
+  String &operator+=(char c) {
+    concat(c);
+    return *this;
+  }
+
+  friend String operator+(const String &a, const String &b) { return String(a.value + b.value); }
+  friend String operator+(const String &a, const char *b) { return String(a.value + b); }
+  friend String operator+(const char *a, const String &b) { return String(a + b.value); }
+
+  bool equals(const String &other) const { return value == other.value; }
+  bool equals(const char *other) const { return other != NULL && value == other; }
+  bool operator==(const String &other) const { return value == other.value; }
+  bool operator==(const char *other) const { return equals(other); }
+  bool operator!=(const String &other) const { return value != other.value; }
+  bool operator<(const String &other) const { return value < other.value; }
+
+  char operator[](unsigned int index) const { return value[index]; }
+  char charAt(unsigned int index) const { return value[index]; }
+  int indexOf(char c) const { return find(value.find(c)); }
+  int indexOf(const String &other) const { return find(value.find(other.value)); }
+  bool startsWith(const String &prefix) const { return value.rfind(prefix.value, 0) == 0; }
+  bool endsWith(const String &suffix) const {
+    return value.size() >= suffix.value.size() && value.compare(value.size() - suffix.value.size(), suffix.value.size(), suffix.value) == 0;
+  }
+  String substring(unsigned int from) const { return value.substr(std::min(from, length())); }
+  String substring(unsigned int from, unsigned int to) const { return value.substr(std::min(from, length()), to - from); }
+  long toInt() const { return atol(value.c_str()); }
+  void toUpperCase() { std::transform(value.begin(), value.end(), value.begin(), ::toupper); }
+  void toLowerCase() { std::transform(value.begin(), value.end(), value.begin(), ::tolower); }
+  void replace(const String &from, const String &to) {
+    if (from.value.empty()) {
+      return;
+    }
+    for (size_t i = value.find(from.value); i != std::string::npos; i = value.find(from.value, i + to.value.size())) {
+      value.replace(i, from.value.size(), to.value);
+    }
+  }
+
+ private:
+  std::string value;
+
+  static int find(size_t position) { return position == std::string::npos ? -1 : (int)position; }
+
+  template <typename T>
+  static std::string format_integer(T value, unsigned char base) {
+    if (base == 10) {
+      return std::to_string(value);
+    }
+
+    std::string result;
+    unsigned long long remaining = (unsigned long long)value;
+    do {
+      result.insert(result.begin(), "0123456789abcdefghijklmnopqrstuvwxyz"[remaining % base]);
+      remaining /= base;
+    } while (remaining > 0);
+    return result;
+  }
+};
+
+// The type of `String + String` in the real core. ArduinoJson's String support refers to it.
+class StringSumHelper : public String {
+ public:
+  using String::String;
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      write(buffer[i]);
+    }
+    return size;
+  }
+
+  size_t print(const String &value) { return write((const uint8_t *)value.c_str(), value.length()); }
+  size_t print(const char *value) { return print(String(value)); }
+  size_t println(const String &value) { return print(value) + println(); }
+  size_t println(const char *value) { return println(String(value)); }
+  size_t println() { return print("\n"); }
+  size_t printf(const char *format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return write((const uint8_t *)buffer, std::min(length, (int)sizeof(buffer) - 1));
+  }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  size_t readBytes(char *buffer, size_t length) {
+    size_t count = 0;
+    while (count < length && available() > 0) {
+      buffer[count++] = (char)read();
+    }
+    return count;
+  }
+};
+
+// Output is kept for the tests to inspect, input is queued with `inject`
+class HardwareSerial : public Stream {
+ public:
+  std::string output;
+
+  void begin(unsigned long baud) {}
+  operator bool() const { return true; }
+
+  size_t write(uint8_t c) override {
+    output += (char)c;
+    return 1;
+  }
+  int available() override { return input.size(); }
+  int read() override {
+    if (input.empty()) {
+      return -1;
+    }
+    char c = input.front();
+    input.pop_front();
+    return (uint8_t)c;
+  }
+  int peek() override { return input.empty() ? -1 : (uint8_t)input.front(); }
+
+  void inject(const String &data) { input.insert(input.end(), data.c_str(), data.c_str() + data.length()); }
+
+ private:
+  std::deque<char> input;
+};
+
+inline HardwareSerial Serial;
+
+/*
+ * Time
+ */
+
+inline uint64_t mock_time_offset_us = 0;
+
+inline unsigned long micros() {
+  static const auto start = std::chrono::steady_clock::now();
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  return (unsigned long)(elapsed.count() + mock_time_offset_us);
+}
+
+inline unsigned long millis() {
+  return micros() / 1000;
+}
+
+// Moves the clock forward, so tests don't have to wait for animations
+inline void mock_advance_ms(unsigned long ms) {
+  mock_time_offset_us += (uint64_t)ms * 1000;
+}
+
+inline void delay(unsigned long ms) {
+  mock_advance_ms(ms);
+}
+
+inline void yield() {}
+
+/*
+ * Misc
+ */
+
+inline long random(long max) {
+  return max > 0 ? rand() % max : 0;
+}
+
+inline long random(long min, long max) {
+  return min < max ? min + random(max - min) : min;
+}
+
+inline void randomSeed(unsigned long seed) {
+  srand(seed);
+}
+
+// Last mode set on each pin
+inline uint8_t mock_pin_modes[256] = {};
+
+inline void pinMode(uint8_t pin, uint8_t mode) {
+  mock_pin_modes[pin] = mode;
+}
+
+inline void digitalWrite(uint8_t pin, uint8_t value) {}
+inline int digitalRead(uint8_t pin) { return LOW; }
+
+class EspClass {
+ public:
+  uint32_t free_heap = 48 * 1024;
+  uint32_t restarts = 0;
+
+  uint32_t getFreeHeap() { return free_heap; }
+  uint32_t getFlashChipSize() { return 4 * 1024 * 1024; }
+  uint32_t getFlashChipSpeed() { return 40000000; }
+  int getFlashChipMode() { return 0; }
+  uint8_t getCpuFreqMHz() { return 80; }
+  const char *getSdkVersion() { return "native"; }
+  String getCoreVersion() { return "native"; }
+  String getResetReason() { return "native"; }
+  String getResetInfo() { return "native"; }
+  static void restart();
+};
+
+inline EspClass ESP;
+
+inline void EspClass::restart() {
+  ESP.restarts++;
+}
+
+class IPAddress {
+ public:
+  IPAddress() : IPAddress(0, 0, 0, 0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : octets{a, b, c, d} {}
+
+  uint8_t operator[](int index) const { return octets[index]; }
+  String toString() const {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+    return buffer;
+  }
+
+ private:
+  uint8_t octets[4];
+};
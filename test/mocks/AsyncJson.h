@@ -0,0 +1,21 @@
+// Stand-in for AsyncJson, for the native build. Tests post a body with `post`.
+#pragma once
+
+#include <ESPAsyncWebServer.h>
+
+typedef std::function<void(AsyncWebServerRequest *request, JsonVariant &json)> ArJsonRequestHandlerFunction;
+
+class AsyncCallbackJsonWebHandler : public AsyncWebHandler {
+ public:
+  AsyncCallbackJsonWebHandler(const String &uri, ArJsonRequestHandlerFunction callback) : callback(callback) {}
+
+  void post(AsyncWebServerRequest *request, const String &body) {
+    JsonDocument doc;
+    deserializeJson(doc, body);
+    JsonVariant json = doc.as<JsonVariant>();
+    callback(request, json);
+  }
+
+ private:
+  ArJsonRequestHandlerFunction callback;
+};
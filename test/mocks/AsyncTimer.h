@@ -0,0 +1,65 @@
+// Stand-in for AsyncTimer, for the native build. Callbacks run from handle(), once they are due.
+#pragma once
+
+#include <Arduino.h>
+
+class AsyncTimer {
+ public:
+  unsigned short setTimeout(std::function<void()> callback, unsigned long ms) { return add(callback, ms, false); }
+  unsigned short setInterval(std::function<void()> callback, unsigned long ms) { return add(callback, ms, true); }
+
+  void cancel(unsigned short id) {
+    for (Timer &timer : timers) {
+      if (timer.id == id) {
+        timer.active = false;
+      }
+    }
+  }
+
+  void handle() {
+    // Callbacks may add timers, so go by index over the timers that exist now
+    size_t count = timers.size();
+    for (size_t i = 0; i < count; i++) {
+      if (!timers[i].active || (long)(millis() - timers[i].due_ms) < 0) {
+        continue;
+      }
+
+      std::function<void()> callback = timers[i].callback;
+      if (timers[i].interval) {
+        timers[i].due_ms = millis() + timers[i].ms;
+      } else {
+        timers[i].active = false;
+      }
+      callback();
+    }
+
+    timers.erase(std::remove_if(timers.begin(), timers.end(), [](const Timer &timer) {
+                   return !timer.active;
+                 }),
+        timers.end());
+  }
+
+  // Number of timers still waiting to run
+  size_t pending() const {
+    return std::count_if(timers.begin(), timers.end(), [](const Timer &timer) {
+      return timer.active;
+    });
+  }
+
+ private:
+  struct Timer {
+    unsigned short id;
+    std::function<void()> callback;
+    unsigned long ms;
+    unsigned long due_ms;
+    bool interval;
+    bool active;
+  };
+  std::vector<Timer> timers;
+  unsigned short next_id = 1;
+
+  unsigned short add(std::function<void()> callback, unsigned long ms, bool interval) {
+    timers.push_back(Timer{next_id, callback, ms, millis() + ms, interval, true});
+    return next_id++;
+  }
+};
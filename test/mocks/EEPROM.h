@@ -0,0 +1,18 @@
+// Stand-in for the EEPROM library, for the native build
+#pragma once
+
+#include <Arduino.h>
+
+class EEPROMClass {
+ public:
+  uint8_t data[4096];
+
+  void begin(size_t size) {}
+  size_t length() { return sizeof(data); }
+  uint8_t read(int address) { return data[address]; }
+  void write(int address, uint8_t value) { data[address] = value; }
+  bool commit() { return true; }
+  void end() {}
+};
+
+inline EEPROMClass EEPROM;
@@ -0,0 +1,19 @@
+// Stand-in for EEvar, for the native build. The value lives in memory, and saves are counted.
+#pragma once
+
+#include <EEPROM.h>
+
+template <typename T>
+class EEvar {
+ public:
+  unsigned int saves = 0;
+
+  EEvar(const T &value) : value(value) {}
+
+  T *operator->() { return &value; }
+  const T *operator->() const { return &value; }
+  void save() { saves++; }
+
+ private:
+  T value;
+};
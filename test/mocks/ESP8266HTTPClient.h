@@ -0,0 +1,17 @@
+// Stand-in for the ESP8266 HTTP client, for the native build. Requests always fail.
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+#define HTTP_CODE_OK 200
+#define HTTP_CODE_NO_CONTENT 204
+
+class HTTPClient {
+ public:
+  bool begin(WiFiClient &client, const String &url) { return true; }
+  void addHeader(const String &name, const String &value) {}
+  int POST(const String &body) { return -1; }
+  String getString() { return ""; }
+  void end() {}
+  static String errorToString(int error) { return "native"; }
+};
@@ -0,0 +1,88 @@
+// Stand-in for the ESP8266 Wi-Fi library, for the native build. The station never connects.
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+
+#define STATION_IDLE 0
+
+enum WiFiMode_t {
+  WIFI_OFF,
+  WIFI_STA,
+  WIFI_AP,
+  WIFI_AP_STA,
+};
+
+enum WiFiSleepType_t {
+  WIFI_NONE_SLEEP,
+  WIFI_LIGHT_SLEEP,
+  WIFI_MODEM_SLEEP,
+};
+
+enum wl_enc_type {
+  ENC_TYPE_WEP = 5,
+  ENC_TYPE_TKIP = 2,
+  ENC_TYPE_CCMP = 4,
+  ENC_TYPE_NONE = 7,
+  ENC_TYPE_AUTO = 8,
+};
+
+struct WiFiEventStationModeGotIP {
+  IPAddress ip;
+  IPAddress mask;
+  IPAddress gw;
+};
+
+struct WiFiEventStationModeConnected {
+  String ssid;
+  uint8_t bssid[6];
+  uint8_t channel;
+};
+
+struct WiFiEventStationModeDisconnected {
+  String ssid;
+  uint8_t bssid[6];
+  int reason;
+};
+
+typedef std::shared_ptr<void> WiFiEventHandler;
+
+inline int wifi_station_get_connect_status() {
+  return STATION_IDLE;
+}
+
+class WiFiClient {};
+
+class ESP8266WiFiClass {
+ public:
+  bool mode(WiFiMode_t mode) { return true; }
+  bool hostname(const String &name) { return true; }
+  bool setAutoReconnect(bool enabled) { return true; }
+  bool setSleepMode(WiFiSleepType_t type) { return true; }
+  bool softAP(const String &ssid) { return true; }
+  void begin(const char *ssid, const char *pass) {}
+  bool disconnect() { return true; }
+  bool isConnected() { return false; }
+
+  String macAddress() { return "AA:BB:CC:DD:EE:FF"; }
+  String SSID() { return ""; }
+  String BSSIDstr() { return ""; }
+  int32_t RSSI() { return 0; }
+  IPAddress localIP() { return IPAddress(); }
+  IPAddress gatewayIP() { return IPAddress(); }
+  IPAddress subnetMask() { return IPAddress(); }
+  IPAddress dnsIP() { return IPAddress(); }
+
+  void scanNetworksAsync(std::function<void(int)> callback) { callback(0); }
+  int8_t scanComplete() { return 0; }
+  String SSID(uint8_t i) { return ""; }
+  String BSSIDstr(uint8_t i) { return ""; }
+  int32_t RSSI(uint8_t i) { return 0; }
+  uint8_t encryptionType(uint8_t i) { return ENC_TYPE_NONE; }
+
+  WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP &)> callback) { return NULL; }
+  WiFiEventHandler onStationModeConnected(std::function<void(const WiFiEventStationModeConnected &)> callback) { return NULL; }
+  WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected &)> callback) { return NULL; }
+};
+
+inline ESP8266WiFiClass WiFi;
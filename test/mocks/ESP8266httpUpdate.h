@@ -0,0 +1,24 @@
+// Stand-in for the ESP8266 OTA updater, for the native build. There are never updates.
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+enum HTTPUpdateResult {
+  HTTP_UPDATE_FAILED,
+  HTTP_UPDATE_NO_UPDATES,
+  HTTP_UPDATE_OK,
+};
+typedef HTTPUpdateResult t_httpUpdate_return;
+
+class ESP8266HTTPUpdate {
+ public:
+  t_httpUpdate_return update(WiFiClient &client, const String &url, const String &version) { return HTTP_UPDATE_NO_UPDATES; }
+  void onStart(std::function<void()> callback) {}
+  void onEnd(std::function<void()> callback) {}
+  void onProgress(std::function<void(int, int)> callback) {}
+  void onError(std::function<void(int)> callback) {}
+  int getLastError() { return 0; }
+  String getLastErrorString() { return ""; }
+};
+
+inline ESP8266HTTPUpdate ESPhttpUpdate;
@@ -0,0 +1,14 @@
+// Stand-in for the ESP8266 mDNS responder, for the native build.
+#pragma once
+
+#include <Arduino.h>
+
+class MDNSResponder {
+ public:
+  bool begin(const String &hostname) { return true; }
+  void addService(const char *service, const char *protocol, uint16_t port) {}
+  void addServiceTxt(const char *service, const char *protocol, const char *key, const String &value) {}
+  void update() {}
+};
+
+inline MDNSResponder MDNS;
@@ -0,0 +1,2 @@
+// Stand-in for ESPAsyncTCP, for the native build. The web server stand-in doesn't need it.
+#pragma once
@@ -0,0 +1,137 @@
+// Stand-in for ESPAsyncWebServer, for the native build.
+// Requests and WebSocket events are driven by the tests, and responses are recorded.
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+enum WebRequestMethod {
+  HTTP_GET = 0b00000001,
+  HTTP_POST = 0b00000010,
+  HTTP_ANY = 0b01111111,
+};
+
+enum AwsEventType {
+  WS_EVT_CONNECT,
+  WS_EVT_DISCONNECT,
+  WS_EVT_PONG,
+  WS_EVT_ERROR,
+  WS_EVT_DATA,
+};
+
+enum AwsFrameType {
+  WS_CONTINUATION = 0x00,
+  WS_TEXT = 0x01,
+  WS_BINARY = 0x02,
+};
+
+typedef struct {
+  uint8_t message_opcode;
+  uint32_t num;
+  uint8_t final;
+  uint8_t masked;
+  uint8_t opcode;
+  uint64_t len;
+  uint8_t mask[4];
+  uint64_t index;
+} AwsFrameInfo;
+
+class AsyncResponseStream : public Print {
+ public:
+  String body;
+
+  size_t write(uint8_t c) override {
+    body += (char)c;
+    return 1;
+  }
+};
+
+class AsyncWebServerRequest {
+ public:
+  int status = 0;
+  String body;
+  bool sent = false;
+  std::function<void()> disconnect_callback;
+
+  String url() { return "/"; }
+
+  AsyncResponseStream *beginResponseStream(const String &content_type) {
+    stream = AsyncResponseStream();
+    return &stream;
+  }
+
+  void send(AsyncResponseStream *response) {
+    status = 200;
+    body = response->body;
+    sent = true;
+  }
+
+  void send(int code, const String &content_type, const String &content) {
+    status = code;
+    body = content;
+    sent = true;
+  }
+
+  void onDisconnect(std::function<void()> callback) { disconnect_callback = callback; }
+
+ private:
+  AsyncResponseStream stream;
+};
+
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+
+class AsyncWebHandler {
+ public:
+  virtual ~AsyncWebHandler() {}
+};
+
+class AsyncWebSocketClient {
+ public:
+  std::vector<String> messages;
+
+  AsyncWebSocketClient(uint32_t id) : client_id(id) {}
+
+  uint32_t id() { return client_id; }
+  IPAddress remoteIP() { return IPAddress(127, 0, 0, 1); }
+  void text(const String &message) { messages.push_back(message); }
+
+ private:
+  uint32_t client_id;
+};
+
+class AsyncWebSocket;
+typedef std::function<void(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)> AwsEventHandler;
+
+class AsyncWebSocket : public AsyncWebHandler {
+ public:
+  AwsEventHandler handler;
+  std::vector<AsyncWebSocketClient *> clients;
+  std::vector<String> broadcasts;
+
+  AsyncWebSocket(const String &url) {}
+
+  void onEvent(AwsEventHandler handler) { this->handler = handler; }
+  void textAll(const String &message) { broadcasts.push_back(message); }
+  void cleanupClients() {}
+
+  AsyncWebSocketClient *client(uint32_t id) {
+    for (AsyncWebSocketClient *client : clients) {
+      if (client->id() == id) {
+        return client;
+      }
+    }
+    return NULL;
+  }
+};
+
+class AsyncWebServer {
+ public:
+  std::vector<AsyncWebHandler *> handlers;
+
+  AsyncWebServer(uint16_t port) {}
+
+  void addHandler(AsyncWebHandler *handler) { handlers.push_back(handler); }
+  void on(const char *uri, WebRequestMethod method, ArRequestHandlerFunction callback) {}
+  void onNotFound(ArRequestHandlerFunction callback) {}
+  void begin() {}
+};
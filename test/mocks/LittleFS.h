@@ -0,0 +1,111 @@
+// Stand-in for LittleFS, for the native build. Files live in memory.
+#pragma once
+
+#include <Arduino.h>
+
+#include <map>
+#include <memory>
+
+class File : public Stream {
+ public:
+  File() {}
+  File(const String &path, std::shared_ptr<std::string> data, bool write) : path(path), data(data), writable(write) {}
+
+  operator bool() const { return data != NULL || directory; }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override {
+    if (!writable) {
+      return 0;
+    }
+    data->append((const char *)buffer, size);
+    return size;
+  }
+
+  int available() override { return data != NULL ? data->size() - position : 0; }
+  int read() override { return available() > 0 ? (uint8_t)(*data)[position++] : -1; }
+  int peek() override { return available() > 0 ? (uint8_t)(*data)[position] : -1; }
+  int read(uint8_t *buffer, size_t size) {
+    size_t count = std::min(size, (size_t)available());
+    memcpy(buffer, data->data() + position, count);
+    position += count;
+    return count;
+  }
+
+  size_t size() const { return data != NULL ? data->size() : 0; }
+  const char *name() const {
+    const char *slash = strrchr(path.c_str(), '/');
+    return slash != NULL ? slash + 1 : path.c_str();
+  }
+  void close() {
+    data = NULL;
+    directory = false;
+  }
+
+  // Files directly in this directory
+  File openNextFile();
+
+ private:
+  friend class FS;
+
+  String path;
+  std::shared_ptr<std::string> data;
+  bool writable = false;
+  size_t position = 0;
+  bool directory = false;
+  std::vector<String> entries;
+  size_t entry = 0;
+};
+
+class FS {
+ public:
+  std::map<std::string, std::shared_ptr<std::string>> files;
+
+  bool begin() { return true; }
+  bool mkdir(const String &path) { return true; }
+  bool exists(const String &path) { return files.count(path.c_str()) > 0; }
+
+  bool remove(const String &path) { return files.erase(path.c_str()) > 0; }
+
+  bool rename(const String &from, const String &to) {
+    auto it = files.find(from.c_str());
+    if (it == files.end()) {
+      return false;
+    }
+    files[to.c_str()] = it->second;
+    files.erase(it);
+    return true;
+  }
+
+  File open(const String &path, const char *mode) {
+    if (mode[0] == 'w') {
+      files[path.c_str()] = std::make_shared<std::string>();
+      return File(path, files[path.c_str()], true);
+    }
+
+    auto it = files.find(path.c_str());
+    if (it != files.end()) {
+      return File(path, it->second, false);
+    }
+
+    // Any path with files below it is a directory
+    File dir;
+    std::string prefix = std::string(path.c_str()) + "/";
+    for (auto &entry : files) {
+      if (entry.first.rfind(prefix, 0) == 0 && entry.first.find('/', prefix.size()) == std::string::npos) {
+        dir.entries.push_back(entry.first.c_str());
+      }
+    }
+    dir.directory = !dir.entries.empty();
+    return dir;
+  }
+};
+
+inline FS LittleFS;
+
+inline File File::openNextFile() {
+  if (!directory || entry >= entries.size()) {
+    return File();
+  }
+  return LittleFS.open(entries[entry++], "r");
+}
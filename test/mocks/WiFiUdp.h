@@ -0,0 +1,73 @@
+// Stand-in for WiFiUDP, for the native build. Backed by a real non-blocking UDP socket,
+// so tests can send packets to it over loopback.
+#pragma once
+
+#include <Arduino.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class WiFiUDP {
+ public:
+  ~WiFiUDP() { stop(); }
+
+  uint8_t begin(uint16_t port) {
+    stop();
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+      return 0;
+    }
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+      stop();
+      return 0;
+    }
+
+    return 1;
+  }
+
+  void stop() {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  int parsePacket() {
+    if (fd < 0) {
+      return 0;
+    }
+
+    ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+    length = size > 0 ? size : 0;
+    position = 0;
+    return length;
+  }
+
+  int available() { return length - position; }
+
+  int read(uint8_t *data, size_t size) {
+    size_t count = std::min(size, (size_t)available());
+    memcpy(data, buffer + position, count);
+    position += count;
+    return count;
+  }
+
+ private:
+  int fd = -1;
+  uint8_t buffer[65536];
+  size_t length = 0;
+  size_t position = 0;
+};
@@ -0,0 +1,31 @@
+// Stand-in for the ESP8266 core's libb64 decoder, for the native build
+#pragma once
+
+#include <cstring>
+
+inline int base64_decode_value(char value) {
+  const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const char *found = value != '\0' ? strchr(alphabet, value) : NULL;
+  return found != NULL ? found - alphabet : -1;
+}
+
+// Decodes `length` characters into `plaintext`, skipping anything outside the alphabet
+inline int base64_decode_chars(const char *code, const int length, char *plaintext) {
+  int count = 0;
+  int bits = 0;
+  int value = 0;
+  for (int i = 0; i < length; i++) {
+    int digit = base64_decode_value(code[i]);
+    if (digit < 0) {
+      continue;
+    }
+
+    value = ((value << 6) | digit) & 0xFFF;  // At most 6 + 6 pending bits
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      plaintext[count++] = (char)((value >> bits) & 0xFF);
+    }
+  }
+  return count;
+}
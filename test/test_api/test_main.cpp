@@ -0,0 +1,273 @@
+// Request handling: dispatch, batches and parameter validation
+#include <unity.h>
+
+#include "main.cpp"
+
+JsonDocument request(const char *json) {
+  JsonDocument req;
+  deserializeJson(req, json);
+  return handle_message(req);
+}
+
+bool async_safe(const char *json) {
+  JsonDocument req;
+  deserializeJson(req, json);
+  return is_async_safe(req);
+}
+
+void send_ws(AsyncWebSocketClient &client, const char *json) {
+  http::handle_ws_message(&client, (const uint8_t *)json, strlen(json));
+}
+
+void setUp() {
+  if (http::websocket == NULL) {
+    http::setup();
+  }
+
+  config->led_count = 30;
+  config->led_palette_size = 0;
+  config->led_segment_count = 0;
+  config->led_output_count = 0;
+  led::setup();
+}
+
+void tearDown() {}
+
+void test_every_method_is_found() {
+  for (size_t i = 0; i < METHOD_COUNT; i++) {
+    TEST_ASSERT_EQUAL_PTR(&methods[i], find_method(methods[i].name));
+  }
+  TEST_ASSERT_NULL(find_method("led.set_colour"));
+}
+
+void test_unknown_method() {
+  JsonDocument res = request("{\"id\": 7, \"method\": \"led.nope\"}");
+  TEST_ASSERT_EQUAL_STRING("unknown_method", res["error"].as<const char *>());
+  TEST_ASSERT_EQUAL(7, res["id"].as<int>());
+}
+
+void test_missing_method() {
+  JsonDocument res = request("{\"id\": 1}");
+  TEST_ASSERT_EQUAL_STRING("invalid_method", res["error"].as<const char *>());
+}
+
+void test_get_methods() {
+  JsonDocument res = request("{\"method\": \"system.get_methods\"}");
+  JsonArray list = res["result"].as<JsonArray>();
+  TEST_ASSERT_EQUAL(METHOD_COUNT, list.size());
+
+  for (JsonObject item : list) {
+    if (item["name"] == "system.ping") {
+      TEST_ASSERT_TRUE(item["async_safe"].as<bool>());
+      TEST_ASSERT_FALSE(item["mutates"].as<bool>());
+    }
+    if (item["name"] == "led.set_color") {
+      TEST_ASSERT_FALSE(item["async_safe"].as<bool>());
+      TEST_ASSERT_TRUE(item["mutates"].as<bool>());
+    }
+  }
+}
+
+void test_async_safe() {
+  TEST_ASSERT_TRUE(async_safe("{\"method\": \"system.ping\"}"));
+  TEST_ASSERT_TRUE(async_safe("{\"method\": \"led.nope\"}"));
+  TEST_ASSERT_FALSE(async_safe("{\"method\": \"led.set_color\"}"));
+  TEST_ASSERT_FALSE(async_safe("{\"method\": \"led.test_benchmark\"}"));
+  TEST_ASSERT_FALSE(async_safe("[{\"method\": \"system.ping\"}, {\"method\": \"led.set_on\"}]"));
+}
+
+void test_batch_responses_in_order() {
+  JsonDocument res = request(
+      "[{\"id\": 1, \"method\": \"system.ping\"},"
+      " 5,"
+      " {\"id\": 3, \"method\": \"led.nope\"}]");
+  JsonArray responses = res.as<JsonArray>();
+
+  TEST_ASSERT_EQUAL(3, responses.size());
+  TEST_ASSERT_EQUAL(1, responses[0]["id"].as<int>());
+  TEST_ASSERT_TRUE(responses[0]["error"].isNull());
+  TEST_ASSERT_EQUAL_STRING("invalid_request", responses[1]["error"].as<const char *>());
+  TEST_ASSERT_EQUAL(3, responses[2]["id"].as<int>());
+  TEST_ASSERT_EQUAL_STRING("unknown_method", responses[2]["error"].as<const char *>());
+}
+
+void test_batch_limits() {
+  JsonDocument res = request("[]");
+  TEST_ASSERT_EQUAL_STRING("empty_batch", res["error"].as<const char *>());
+
+  String batch = "[";
+  for (int i = 0; i <= MAX_BATCH_REQUESTS; i++) {
+    batch += i > 0 ? ",{\"method\":\"system.ping\"}" : "{\"method\":\"system.ping\"}";
+  }
+  batch += "]";
+  res = request(batch.c_str());
+  TEST_ASSERT_EQUAL_STRING("batch_too_large", res["error"].as<const char *>());
+}
+
+void test_batch_is_one_crossfade() {
+  request(
+      "[{\"method\": \"led.set_color\", \"params\": {\"r\": 255, \"g\": 0, \"b\": 0}},"
+      " {\"method\": \"led.set_color\", \"params\": {\"r\": 0, \"g\": 0, \"b\": 255}}]");
+
+  // The crossfade goes straight to the last color
+  TEST_ASSERT_TRUE(led::segments[0].animating);
+  TEST_ASSERT_EQUAL_UINT8(0, led::colors_target[0].r);
+  TEST_ASSERT_EQUAL_UINT8(255, led::colors_target[0].b);
+}
+
+void test_set_color_validation() {
+  JsonDocument res = request("{\"method\": \"led.set_color\", \"params\": {\"r\": 255}}");
+  TEST_ASSERT_EQUAL_STRING("invalid_color", res["error"].as<const char *>());
+
+  res = request("{\"method\": \"led.set_color\", \"params\": {\"segment\": 9, \"r\": 1, \"g\": 2, \"b\": 3}}");
+  TEST_ASSERT_EQUAL_STRING("invalid_segment", res["error"].as<const char *>());
+}
+
+void test_set_gradient_positions() {
+  JsonDocument res = request(
+      "{\"method\": \"led.set_gradient\", \"params\": {\"colors\": ["
+      "{\"r\": 255, \"g\": 0, \"b\": 0, \"position\": 0},"
+      "{\"r\": 0, \"g\": 0, \"b\": 255, \"position\": 0.5}]}}");
+  TEST_ASSERT_TRUE(res["error"].isNull());
+
+  // Past the last stop, the pixels keep its color
+  TEST_ASSERT_EQUAL_UINT8(255, led::colors_target[29].b);
+
+  res = request(
+      "{\"method\": \"led.set_gradient\", \"params\": {\"colors\": ["
+      "{\"r\": 255, \"g\": 0, \"b\": 0, \"position\": 0.5},"
+      "{\"r\": 0, \"g\": 0, \"b\": 255, \"position\": 0.25}]}}");
+  TEST_ASSERT_EQUAL_STRING("position_out_of_range", res["error"].as<const char *>());
+
+  // Positions are given for every stop or for none
+  res = request(
+      "{\"method\": \"led.set_gradient\", \"params\": {\"colors\": ["
+      "{\"r\": 255, \"g\": 0, \"b\": 0},"
+      "{\"r\": 0, \"g\": 0, \"b\": 255, \"position\": 0.5}]}}");
+  TEST_ASSERT_EQUAL_STRING("invalid_position", res["error"].as<const char *>());
+
+  res = request(
+      "{\"method\": \"led.set_gradient\", \"params\": {\"colors\": ["
+      "{\"r\": 255, \"g\": 0, \"b\": 0, \"position\": 0},"
+      "{\"r\": 0, \"g\": 0, \"b\": 255}]}}");
+  TEST_ASSERT_EQUAL_STRING("invalid_position", res["error"].as<const char *>());
+}
+
+void test_ws_replies_in_order() {
+  AsyncWebSocketClient client(1);
+  AsyncWebSocketClient other(2);
+  http::websocket->clients = {&client, &other};
+
+  // The read waits behind the queued mutation, other clients are answered right away
+  send_ws(client, "{\"id\": 1, \"method\": \"led.set_on\", \"params\": {\"on\": false}}");
+  send_ws(client, "{\"id\": 2, \"method\": \"system.ping\"}");
+  send_ws(other, "{\"id\": 3, \"method\": \"system.ping\"}");
+  TEST_ASSERT_EQUAL(0, client.messages.size());
+  TEST_ASSERT_EQUAL(1, other.messages.size());
+
+  http::loop();
+  TEST_ASSERT_EQUAL(2, client.messages.size());
+
+  JsonDocument first;
+  deserializeJson(first, client.messages[0].c_str());
+  JsonDocument second;
+  deserializeJson(second, client.messages[1].c_str());
+  TEST_ASSERT_EQUAL(1, first["id"].as<int>());
+  TEST_ASSERT_EQUAL(2, second["id"].as<int>());
+
+  // With nothing queued, reads are answered inline again
+  send_ws(client, "{\"id\": 4, \"method\": \"system.ping\"}");
+  TEST_ASSERT_EQUAL(3, client.messages.size());
+
+  http::websocket->clients.clear();
+}
+
+void test_script_hash() {
+  const char *a = "led.set(1, 0xff0000)";
+  const char *b = "led.set(1, 0x00ff00)";
+  String hash = led::hash_script((const uint8_t *)a, strlen(a));
+
+  TEST_ASSERT_TRUE(led::is_script_hash(hash));
+  TEST_ASSERT_TRUE(hash.equals(led::hash_script((const uint8_t *)a, strlen(a))));
+  TEST_ASSERT_FALSE(hash.equals(led::hash_script((const uint8_t *)b, strlen(b))));
+
+  // The key ends with the script's length
+  TEST_ASSERT_TRUE(hash.endsWith("00000014"));
+  TEST_ASSERT_FALSE(led::is_script_hash("0123abcd"));
+}
+
+void test_stale_scripts_removed() {
+  LittleFS.files.clear();
+  String hash = led::hash_script((const uint8_t *)"x", 1);
+  led::save_script(hash, (const uint8_t *)"x", 1);
+  led::save_script("0123abcd", (const uint8_t *)"y", 1);
+
+  led::clean_scripts();
+  TEST_ASSERT_TRUE(led::has_script(hash));
+  TEST_ASSERT_FALSE(led::has_script("0123abcd"));
+}
+
+void test_start_lua_after_segments_change() {
+  request(
+      "{\"method\": \"led.set_segments\", \"params\": {\"segments\": ["
+      "{\"start\": 0, \"length\": 10}, {\"start\": 10, \"length\": 10}, {\"start\": 20, \"length\": 10}]}}");
+
+  // The start is deferred, and by then the segment it was given is gone
+  JsonDocument res = request(
+      "[{\"method\": \"led.start_lua\", \"params\": {\"segment\": 2, \"script\": \"led.show()\"}},"
+      " {\"method\": \"led.set_segments\", \"params\": {\"segments\": [{\"start\": 0, \"length\": 30}]}}]");
+  TEST_ASSERT_TRUE(res[0]["error"].isNull());
+  TEST_ASSERT_TRUE(res[1]["error"].isNull());
+
+  mock_advance_ms(200);
+  timer.handle();
+  TEST_ASSERT_FALSE(led::lua_running);
+
+  // Likewise when palette mode is turned on in between
+  request(
+      "[{\"method\": \"led.start_lua\", \"params\": {\"script\": \"led.show()\"}},"
+      " {\"method\": \"led.set_palette_size\", \"params\": {\"size\": 16}}]");
+  mock_advance_ms(200);
+  timer.handle();
+  TEST_ASSERT_FALSE(led::lua_running);
+}
+
+void test_bytecode_header() {
+  // The header lua_dump writes on this build, then the chunk
+  std::vector<uint8_t> chunk = {0x1B, 'L', 'u', 'a', 0x53, 0x00, 0x19, 0x93, '\r', '\n', 0x1A, '\n',
+      sizeof(int), sizeof(size_t), 4, sizeof(lua_Integer), sizeof(lua_Number)};
+  lua_Integer integer = 0x5678;
+  lua_Number number = 370.5;
+  chunk.insert(chunk.end(), (uint8_t *)&integer, (uint8_t *)&integer + sizeof(integer));
+  chunk.insert(chunk.end(), (uint8_t *)&number, (uint8_t *)&number + sizeof(number));
+  chunk.push_back(1);
+  TEST_ASSERT_TRUE(led::is_compatible_bytecode(chunk.data(), chunk.size()));
+
+  // Bytecode from a build with another size_t
+  chunk[13] = sizeof(size_t) == 8 ? 4 : 8;
+  TEST_ASSERT_FALSE(led::is_compatible_bytecode(chunk.data(), chunk.size()));
+
+  // The signature alone isn't enough
+  JsonDocument res = request("{\"method\": \"led.start_lua\", \"params\": {\"bytecode\": \"G0x1YQ==\"}}");
+  TEST_ASSERT_EQUAL_STRING("invalid_bytecode", res["error"].as<const char *>());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_every_method_is_found);
+  RUN_TEST(test_unknown_method);
+  RUN_TEST(test_missing_method);
+  RUN_TEST(test_get_methods);
+  RUN_TEST(test_async_safe);
+  RUN_TEST(test_batch_responses_in_order);
+  RUN_TEST(test_batch_limits);
+  RUN_TEST(test_batch_is_one_crossfade);
+  RUN_TEST(test_set_color_validation);
+  RUN_TEST(test_set_gradient_positions);
+  RUN_TEST(test_ws_replies_in_order);
+  RUN_TEST(test_script_hash);
+  RUN_TEST(test_stale_scripts_removed);
+  RUN_TEST(test_start_lua_after_segments_change);
+  RUN_TEST(test_bytecode_header);
+  return UNITY_END();
+}
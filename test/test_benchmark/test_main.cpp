@@ -0,0 +1,149 @@
+// Render pipeline microbenchmarks. Budgets are loose, so only a change in complexity
+// (a per-pixel division, a quadratic loop) fails them on a CI runner.
+#include <unity.h>
+
+#include "main.cpp"
+
+const int COUNT = 1000;
+const int ITERATIONS = 200;
+const uint32_t BUDGET_NS_PER_PIXEL = 200;
+
+ColorRGBW from[COUNT];
+ColorRGBW to[COUNT];
+ColorRGBW out[COUNT];
+
+// Average time per pixel of `fn`, in nanoseconds
+template <typename F>
+uint32_t time_per_pixel(const char *name, F fn) {
+  unsigned long start = micros();
+  for (int n = 0; n < ITERATIONS; n++) {
+    fn(n);
+  }
+  uint32_t ns = (uint64_t)(micros() - start) * 1000 / ITERATIONS / COUNT;
+
+  char message[64];
+  snprintf(message, sizeof(message), "%s: %u ns/pixel", name, (unsigned int)ns);
+  TEST_MESSAGE(message);
+
+  return ns;
+}
+
+void setUp() {
+  config->led_count = 60;
+  config->led_type = LedType::SK6812;
+  config->led_palette_size = 0;
+  config->led_segment_count = 0;
+  config->led_output_count = 0;
+  led::setup();
+
+  for (int i = 0; i < COUNT; i++) {
+    from[i] = ColorRGBW{.r = (uint8_t)i, .g = (uint8_t)(i * 3), .b = (uint8_t)(i * 7), .w = (uint8_t)(i * 11)};
+    to[i] = ColorRGBW{.r = (uint8_t)(i * 5), .g = (uint8_t)(i * 2), .b = 255, .w = 0};
+  }
+}
+
+void tearDown() {}
+
+void test_blend() {
+  uint32_t ns = time_per_pixel("blend", [](int n) {
+    led::blend_pixels(out, from, to, COUNT, (uint8_t)n);
+  });
+  TEST_ASSERT_LESS_THAN(BUDGET_NS_PER_PIXEL, ns);
+}
+
+void test_gradient() {
+  led::GradientStop stops[16];
+  for (int k = 0; k < 16; k++) {
+    stops[k] = led::GradientStop{.color = from[k * 37], .position = (uint32_t)k * 65536 / 15};
+  }
+
+  uint32_t ns = time_per_pixel("gradient", [&](int n) {
+    led::fill_gradient(out, COUNT, stops, 16, false);
+  });
+  TEST_ASSERT_LESS_THAN(BUDGET_NS_PER_PIXEL, ns);
+
+  ns = time_per_pixel("gradient_hsv", [&](int n) {
+    led::fill_gradient(out, COUNT, stops, 16, true);
+  });
+  TEST_ASSERT_LESS_THAN(BUDGET_NS_PER_PIXEL, ns);
+}
+
+void test_output() {
+  Adafruit_NeoPixel strip(COUNT, -1, NEO_GRBW + NEO_KHZ800);
+  uint32_t sink = 0;
+
+  uint32_t ns = time_per_pixel("output", [&](int n) {
+    led::write_pixels(&strip, from, 0, COUNT);
+  });
+  TEST_ASSERT_LESS_THAN(BUDGET_NS_PER_PIXEL, ns);
+
+  ns = time_per_pixel("hash", [&](int n) {
+    sink += led::hash_strip(strip.getPixels(), COUNT * 4);
+  });
+  TEST_ASSERT_LESS_THAN(BUDGET_NS_PER_PIXEL, ns);
+  TEST_ASSERT_NOT_EQUAL(0, sink);
+}
+
+void test_frame() {
+  config->led_count = COUNT;
+  led::setup();
+  led::set_color(led::segments[0], to[0]);
+
+  // Frames of the running crossfade, through to the strip. The clock moves between frames.
+  unsigned long elapsed = 0;
+  for (int n = 0; n < ITERATIONS; n++) {
+    mock_advance_ms(1);
+    unsigned long start = micros();
+    led::render_frame();
+    elapsed += micros() - start;
+  }
+  uint32_t ns = (uint64_t)elapsed * 1000 / ITERATIONS / COUNT;
+
+  char message[64];
+  snprintf(message, sizeof(message), "frame: %u ns/pixel", (unsigned int)ns);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_LESS_THAN(BUDGET_NS_PER_PIXEL, ns);
+}
+
+void test_dispatch() {
+  std::vector<String> names;
+  for (size_t i = 0; i < METHOD_COUNT; i++) {
+    names.push_back(methods[i].name);
+  }
+
+  size_t found = 0;
+  unsigned long start = micros();
+  for (int n = 0; n < ITERATIONS; n++) {
+    for (const String &name : names) {
+      found += find_method(name) != NULL;
+    }
+  }
+  uint32_t ns = (uint64_t)(micros() - start) * 1000 / ITERATIONS / METHOD_COUNT;
+
+  char message[64];
+  snprintf(message, sizeof(message), "dispatch: %u ns/lookup", (unsigned int)ns);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_EQUAL(ITERATIONS * METHOD_COUNT, found);
+  TEST_ASSERT_LESS_THAN(BUDGET_NS_PER_PIXEL, ns);
+}
+
+void test_benchmark_leaves_strip_alone() {
+  uint32_t shows = led::outputs[0].strip->shows;
+
+  led::benchmark(COUNT, 2);
+
+  // The scratch strip has no pin, so the live one stays an output
+  TEST_ASSERT_EQUAL_UINT8(OUTPUT, mock_pin_modes[led::get_pin()]);
+  TEST_ASSERT_EQUAL_UINT32(shows, led::outputs[0].strip->shows);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_blend);
+  RUN_TEST(test_gradient);
+  RUN_TEST(test_output);
+  RUN_TEST(test_frame);
+  RUN_TEST(test_dispatch);
+  RUN_TEST(test_benchmark_leaves_strip_alone);
+  return UNITY_END();
+}
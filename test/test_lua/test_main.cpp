@@ -0,0 +1,78 @@
+// Lua scripts: the collector, stepped in the slack after each frame
+#include <unity.h>
+
+#include "main.cpp"
+
+// Builds a table once, drops it after half a second, and makes garbage every frame
+const char *SCRIPT =
+    "big = {}\n"
+    "for i = 1, 1000 do big[i] = i end\n"
+    "function render(t, dt)\n"
+    "  if t > 500 then big = nil end\n"
+    "  local garbage = {}\n"
+    "  for i = 1, 50 do garbage[i] = {i} end\n"
+    "end\n";
+
+// Runs the next frame, and the collector after it
+void run_frame() {
+  mock_advance_ms(led::frame_interval_us / 1000 + 1);
+  led::loop();
+}
+
+void start_script(const char *script) {
+  String hash = led::hash_script((const uint8_t *)script, strlen(script));
+  led::save_script(hash, (const uint8_t *)script, strlen(script));
+
+  LuaOptions options;
+  options.memory_limit = 64 * 1024;
+  led::start_lua(hash, options);
+}
+
+void setUp() {
+  LittleFS.files.clear();
+  config->led_count = 30;
+  config->led_type = LedType::SK6812;
+  config->led_palette_size = 0;
+  config->led_segment_count = 0;
+  config->led_output_count = 0;
+  led::setup();
+}
+
+void tearDown() {
+  led::stop_lua();
+}
+
+void test_gc_cycle_fits_in_slack() {
+  start_script(SCRIPT);
+  TEST_ASSERT_TRUE(led::lua_running);
+
+  // The script starts above the first threshold, and its heap is small enough to collect in one frame
+  run_frame();
+  TEST_ASSERT_GREATER_THAN(0, led::lua_stats.gc_steps);
+  TEST_ASSERT_EQUAL_UINT32(1, led::lua_stats.gc_cycles);
+  TEST_ASSERT_FALSE(led::lua_gc_collecting);
+}
+
+void test_gc_live_goes_down() {
+  start_script(SCRIPT);
+
+  for (int n = 0; n < 10 && led::lua_stats.gc_cycles == 0; n++) {
+    run_frame();
+  }
+  size_t live = led::lua_gc_live;
+  TEST_ASSERT_GREATER_THAN(0, live);
+
+  // Once the script drops the table, a later cycle finds less live data
+  for (int n = 0; n < 300 && led::lua_gc_live >= live; n++) {
+    run_frame();
+  }
+  TEST_ASSERT_TRUE(led::lua_running);
+  TEST_ASSERT_LESS_THAN(live, led::lua_gc_live);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_gc_cycle_fits_in_slack);
+  RUN_TEST(test_gc_live_goes_down);
+  return UNITY_END();
+}
@@ -0,0 +1,254 @@
+// Render pipeline: blending, gradients, transitions and outputs
+#include <unity.h>
+
+#include "main.cpp"
+
+const int COUNT = 30;
+
+const ColorRGBW red = ColorRGBW{.r = 255, .g = 0, .b = 0, .w = 0};
+const ColorRGBW blue = ColorRGBW{.r = 0, .g = 0, .b = 255, .w = 0};
+
+// Runs frames until the transitions have finished
+void render_settled() {
+  led::render_frame();
+  mock_advance_ms(led::ANIMATE_SPEED + 1);
+  led::render_frame();
+}
+
+void assert_color(const ColorRGBW &expected, const ColorRGBW &actual) {
+  TEST_ASSERT_EQUAL_UINT8(expected.r, actual.r);
+  TEST_ASSERT_EQUAL_UINT8(expected.g, actual.g);
+  TEST_ASSERT_EQUAL_UINT8(expected.b, actual.b);
+  TEST_ASSERT_EQUAL_UINT8(expected.w, actual.w);
+}
+
+// The color after the segment's brightness
+ColorRGBW scaled(const ColorRGBW &color) {
+  const uint8_t *table = led::segments[0].brightness_table;
+  return ColorRGBW{.r = table[color.r], .g = table[color.g], .b = table[color.b], .w = table[color.w]};
+}
+
+void setUp() {
+  config->led_count = COUNT;
+  config->led_type = LedType::SK6812;
+  config->led_palette_size = 0;
+  config->led_segment_count = 0;
+  config->led_output_count = 0;
+  led::setup();
+  render_settled();
+}
+
+void tearDown() {}
+
+void test_blend_pixel_endpoints() {
+  ColorRGBW from = ColorRGBW{.r = 10, .g = 20, .b = 30, .w = 40};
+  ColorRGBW to = ColorRGBW{.r = 250, .g = 240, .b = 230, .w = 220};
+
+  assert_color(from, led::blend_pixel(from, to, 0));
+  assert_color(to, led::blend_pixel(from, to, 255));
+}
+
+void test_blend_pixel_midpoint() {
+  ColorRGBW black = color_rgbw_black;
+  ColorRGBW white = ColorRGBW{.r = 255, .g = 255, .b = 255, .w = 255};
+
+  ColorRGBW mid = led::blend_pixel(black, white, 128);
+  TEST_ASSERT_UINT8_WITHIN(1, 128, mid.r);
+  TEST_ASSERT_UINT8_WITHIN(1, 128, mid.g);
+  TEST_ASSERT_UINT8_WITHIN(1, 128, mid.b);
+  TEST_ASSERT_UINT8_WITHIN(1, 128, mid.w);
+}
+
+void test_fill_gradient_two_stops() {
+  led::GradientStop stops[] = {
+      led::GradientStop{.color = red, .position = 0},
+      led::GradientStop{.color = blue, .position = 65536},
+  };
+  ColorRGBW out[11];
+  led::fill_gradient(out, 11, stops, 2, false);
+
+  assert_color(red, out[0]);
+  assert_color(blue, out[10]);
+  TEST_ASSERT_UINT8_WITHIN(2, 128, out[5].r);
+  TEST_ASSERT_UINT8_WITHIN(2, 128, out[5].b);
+
+  // Red fades out and blue fades in monotonically
+  for (int i = 1; i < 11; i++) {
+    TEST_ASSERT_LESS_OR_EQUAL(out[i - 1].r, out[i].r);
+    TEST_ASSERT_GREATER_OR_EQUAL(out[i - 1].b, out[i].b);
+  }
+}
+
+void test_fill_gradient_clamps_outside_stops() {
+  led::GradientStop stops[] = {
+      led::GradientStop{.color = red, .position = 16384},
+      led::GradientStop{.color = blue, .position = 49152},
+  };
+  ColorRGBW out[9];
+  led::fill_gradient(out, 9, stops, 2, false);
+
+  assert_color(red, out[0]);
+  assert_color(red, out[1]);
+  assert_color(blue, out[7]);
+  assert_color(blue, out[8]);
+}
+
+void test_set_color_crossfades() {
+  led::set_color(led::segments[0], red);
+  led::render_frame();
+
+  // Halfway through, the pixels are between the initial white and red
+  mock_advance_ms(led::ANIMATE_SPEED / 2);
+  led::render_frame();
+  TEST_ASSERT_TRUE(led::segments[0].animating);
+  TEST_ASSERT_GREATER_THAN(0, led::pixels_current[0].r);
+  TEST_ASSERT_LESS_THAN(scaled(red).r, led::pixels_current[0].r);
+
+  mock_advance_ms(led::ANIMATE_SPEED);
+  led::render_frame();
+  TEST_ASSERT_FALSE(led::segments[0].animating);
+  for (int i = 0; i < COUNT; i++) {
+    assert_color(scaled(red), led::pixels_current[i]);
+  }
+}
+
+void test_frame_reaches_strip() {
+  led::set_color(led::segments[0], red);
+  render_settled();
+
+  // GRBW byte order, through the output tables
+  const uint8_t *bytes = led::outputs[0].strip->getPixels();
+  for (int i = 0; i < COUNT; i++) {
+    TEST_ASSERT_EQUAL_UINT8(led::output_table_g.values[0], bytes[i * 4 + 0]);
+    TEST_ASSERT_EQUAL_UINT8(led::output_table_r.values[scaled(red).r], bytes[i * 4 + 1]);
+    TEST_ASSERT_EQUAL_UINT8(led::output_table_b.values[0], bytes[i * 4 + 2]);
+  }
+}
+
+void test_unchanged_frame_is_not_shown() {
+  uint32_t shows = led::outputs[0].strip->shows;
+
+  // Nothing changes, so nothing is rendered or shown
+  mock_advance_ms(100);
+  led::render_frame();
+  TEST_ASSERT_EQUAL_UINT32(shows, led::outputs[0].strip->shows);
+
+  led::set_color(led::segments[0], blue);
+  render_settled();
+  TEST_ASSERT_GREATER_THAN(shows, led::outputs[0].strip->shows);
+}
+
+void test_batch_coalesces_crossfades() {
+  led::begin_batch();
+  led::set_color(led::segments[0], red);
+  led::set_color(led::segments[0], blue);
+  TEST_ASSERT_FALSE(led::segments[0].animating);
+  led::end_batch();
+
+  // A single crossfade, straight to the final color
+  TEST_ASSERT_TRUE(led::segments[0].animating);
+  render_settled();
+  assert_color(scaled(blue), led::pixels_current[0]);
+}
+
+void test_segment_gaps_go_black() {
+  led::set_color(led::segments[0], red);
+  render_settled();
+
+  // Pixels 10 to 19 are in no segment of the new layout
+  led::set_segments({
+      SegmentConfig{.start = 0, .length = 10, .reverse = false},
+      SegmentConfig{.start = 20, .length = 10, .reverse = false},
+  });
+  render_settled();
+
+  for (int i = 10; i < 20; i++) {
+    assert_color(color_rgbw_black, led::frame_pixels[i]);
+  }
+  const uint8_t *bytes = led::outputs[0].strip->getPixels();
+  TEST_ASSERT_EQUAL_UINT8(led::output_table_r.values[0], bytes[15 * 4 + 1]);
+  assert_color(scaled(led::initial_color), led::frame_pixels[0]);
+  assert_color(scaled(led::initial_color), led::frame_pixels[29]);
+}
+
+void test_realtime_replaces_frame() {
+  uint8_t data[] = {1, 2, 3, 4, 5, 6};
+  TEST_ASSERT_TRUE(led::write_realtime(REALTIME_DDP, DEFAULT_REALTIME_PRIORITY, 0, 3, data, 2, 3));
+  led::render_frame();
+
+  TEST_ASSERT_EQUAL(REALTIME_DDP, led::realtime_source);
+  assert_color(ColorRGBW{.r = 1, .g = 2, .b = 3, .w = 0}, led::frame_pixels[3]);
+  assert_color(ColorRGBW{.r = 4, .g = 5, .b = 6, .w = 0}, led::frame_pixels[4]);
+
+  // The rendered frame comes back once the stream times out
+  mock_advance_ms(config->realtime_timeout + 1);
+  led::render_frame();
+  TEST_ASSERT_EQUAL(REALTIME_NONE, led::realtime_source);
+  assert_color(led::pixels_current[3], led::frame_pixels[3]);
+}
+
+void test_realtime_priority() {
+  uint8_t data[] = {1, 2, 3};
+  TEST_ASSERT_TRUE(led::write_realtime(REALTIME_DDP, 100, 0, 0, data, 1, 3));
+
+  // A lower priority stream can't take over, a higher one can
+  TEST_ASSERT_FALSE(led::write_realtime(REALTIME_ARTNET, 50, 0, 0, data, 1, 3));
+  TEST_ASSERT_TRUE(led::write_realtime(REALTIME_E131, 150, 0, 0, data, 1, 3));
+  TEST_ASSERT_EQUAL(REALTIME_E131, led::realtime_source);
+
+  led::stop_realtime();
+}
+
+void test_zero_leds() {
+  config->led_count = 0;
+  led::setup();
+
+  // Everything still works, there is just nothing to show
+  led::set_color(led::segments[0], red);
+  led::set_animation(led::segments[0], led::find_effect("rainbow"), led::EffectParams());
+  render_settled();
+  TEST_ASSERT_EQUAL(0, led::get_count());
+}
+
+void test_effect_runs_for_hours() {
+  led::Segment &segment = led::segments[0];
+  led::EffectParams params;
+  params.speed = 255;
+  params.color = red;
+  led::set_animation(segment, led::find_effect("comet"), params);
+
+  // Five hours in, t * speed no longer fits in 32 bits
+  mock_advance_ms(5UL * 3600 * 1000);
+  led::render_frame();
+  // The mock clock also runs in real time, so allow for the time the test itself takes
+  TEST_ASSERT_TRUE(segment.effect_ms >= 5ULL * 3600 * 1000);
+  TEST_ASSERT_TRUE(segment.effect_ms < 5ULL * 3600 * 1000 + 1000);
+
+  // The head is where the 64-bit phase puts it
+  int tail = 1 + params.density * COUNT / 512;
+  int head = ((segment.effect_ms * params.speed) >> 11) % (COUNT + tail);
+  if (head < COUNT) {
+    assert_color(red, led::colors_target[head]);
+  }
+  for (int i = head + 1; i < COUNT; i++) {
+    assert_color(color_rgbw_black, led::colors_target[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_blend_pixel_endpoints);
+  RUN_TEST(test_blend_pixel_midpoint);
+  RUN_TEST(test_fill_gradient_two_stops);
+  RUN_TEST(test_fill_gradient_clamps_outside_stops);
+  RUN_TEST(test_set_color_crossfades);
+  RUN_TEST(test_frame_reaches_strip);
+  RUN_TEST(test_unchanged_frame_is_not_shown);
+  RUN_TEST(test_batch_coalesces_crossfades);
+  RUN_TEST(test_segment_gaps_go_black);
+  RUN_TEST(test_realtime_replaces_frame);
+  RUN_TEST(test_realtime_priority);
+  RUN_TEST(test_zero_leds);
+  RUN_TEST(test_effect_runs_for_hours);
+  return UNITY_END();
+}
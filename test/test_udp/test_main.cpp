@@ -0,0 +1,179 @@
+// Realtime streams over UDP, sent to the receiver over loopback
+#include <unity.h>
+
+#include "main.cpp"
+
+int sender = -1;
+
+void send_packet(int port, const std::vector<uint8_t> &packet) {
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  sendto(sender, packet.data(), packet.size(), 0, (sockaddr *)&address, sizeof(address));
+}
+
+// Receives the packets sent so far and presents the frame
+void receive() {
+  udp::loop();
+  led::render_frame();
+}
+
+std::vector<uint8_t> ddp_packet(uint8_t sequence, uint32_t offset, const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> packet = {
+      0x41,  // Version 1, push
+      sequence,
+      0x0B,  // 8-bit RGB
+      0x01,
+      (uint8_t)(offset >> 24),
+      (uint8_t)(offset >> 16),
+      (uint8_t)(offset >> 8),
+      (uint8_t)offset,
+      (uint8_t)(data.size() >> 8),
+      (uint8_t)data.size(),
+  };
+  packet.insert(packet.end(), data.begin(), data.end());
+  return packet;
+}
+
+std::vector<uint8_t> e131_packet(uint8_t sender_id, uint8_t priority, int universe, uint8_t sequence, uint8_t options, const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> packet(126, 0);
+  memcpy(packet.data() + 4, udp::E131_ID, sizeof(udp::E131_ID));
+  packet[21] = 0x04;
+  memset(packet.data() + 22, sender_id, udp::E131_CID_SIZE);
+  packet[43] = 0x02;
+  packet[108] = priority;
+  packet[111] = sequence;
+  packet[112] = options;
+  packet[113] = universe >> 8;
+  packet[114] = universe;
+  packet[117] = 0x02;
+  packet[123] = (data.size() + 1) >> 8;
+  packet[124] = data.size() + 1;
+  packet.insert(packet.end(), data.begin(), data.end());
+  return packet;
+}
+
+std::vector<uint8_t> artnet_packet(uint8_t sequence, int universe, const std::vector<uint8_t> &data) {
+  std::vector<uint8_t> packet = {'A', 'r', 't', '-', 'N', 'e', 't', 0, 0x00, 0x50, 0, 14, sequence, 0};
+  packet.push_back(universe);
+  packet.push_back(universe >> 8);
+  packet.push_back(data.size() >> 8);
+  packet.push_back(data.size());
+  packet.insert(packet.end(), data.begin(), data.end());
+  return packet;
+}
+
+void assert_pixel(int i, uint8_t r, uint8_t g, uint8_t b, uint8_t w) {
+  TEST_ASSERT_EQUAL_UINT8(r, led::frame_pixels[i].r);
+  TEST_ASSERT_EQUAL_UINT8(g, led::frame_pixels[i].g);
+  TEST_ASSERT_EQUAL_UINT8(b, led::frame_pixels[i].b);
+  TEST_ASSERT_EQUAL_UINT8(w, led::frame_pixels[i].w);
+}
+
+void setUp() {
+  if (sender < 0) {
+    sender = socket(AF_INET, SOCK_DGRAM, 0);
+    udp::setup();
+  }
+
+  config->led_count = 200;
+  config->led_type = LedType::SK6812;
+  config->led_palette_size = 0;
+  config->led_segment_count = 0;
+  config->led_output_count = 0;
+  config->udp_universe = 1;
+  led::setup();
+}
+
+void tearDown() {}
+
+void test_ddp() {
+  send_packet(udp::DDP_PORT, ddp_packet(1, 3 * 10, {1, 2, 3, 4, 5, 6}));
+  receive();
+
+  TEST_ASSERT_EQUAL(REALTIME_DDP, led::realtime_source);
+  assert_pixel(10, 1, 2, 3, 0);
+  assert_pixel(11, 4, 5, 6, 0);
+}
+
+void test_e131() {
+  // RGBW, 128 pixels per universe. The second universe starts at pixel 128.
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 1, 1, 0, {1, 2, 3, 4}));
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 2, 1, 0, {5, 6, 7, 8}));
+  receive();
+
+  TEST_ASSERT_EQUAL(REALTIME_E131, led::realtime_source);
+  assert_pixel(0, 1, 2, 3, 4);
+  assert_pixel(128, 5, 6, 7, 8);
+}
+
+void test_artnet() {
+  send_packet(udp::ARTNET_PORT, artnet_packet(1, 1, {9, 8, 7, 6}));
+  receive();
+
+  TEST_ASSERT_EQUAL(REALTIME_ARTNET, led::realtime_source);
+  assert_pixel(0, 9, 8, 7, 6);
+}
+
+void test_e131_late_packet_dropped() {
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 1, 10, 0, {1, 1, 1, 1}));
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 1, 9, 0, {2, 2, 2, 2}));
+  receive();
+
+  assert_pixel(0, 1, 1, 1, 1);
+}
+
+void test_e131_terminate_needs_active_sender() {
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 1, 1, 0, {1, 2, 3, 4}));
+  receive();
+
+  // Another sender, or a universe the strip doesn't show, can't end the stream
+  send_packet(udp::E131_PORT, e131_packet(0xB2, 100, 1, 1, 0x40, {}));
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 9, 2, 0x40, {}));
+  receive();
+  TEST_ASSERT_EQUAL(REALTIME_E131, led::realtime_source);
+
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 1, 3, 0x40, {}));
+  receive();
+  TEST_ASSERT_EQUAL(REALTIME_NONE, led::realtime_source);
+}
+
+void test_e131_priority_between_senders() {
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 1, 1, 0, {1, 1, 1, 1}));
+  receive();
+
+  // Lower and equal priorities don't interleave with the active sender
+  send_packet(udp::E131_PORT, e131_packet(0xB2, 50, 1, 1, 0, {2, 2, 2, 2}));
+  send_packet(udp::E131_PORT, e131_packet(0xC3, 100, 1, 1, 0, {3, 3, 3, 3}));
+  receive();
+  assert_pixel(0, 1, 1, 1, 1);
+
+  // A higher priority takes over, and the previous sender is then ignored
+  send_packet(udp::E131_PORT, e131_packet(0xB2, 150, 1, 1, 0, {4, 4, 4, 4}));
+  send_packet(udp::E131_PORT, e131_packet(0xA1, 100, 1, 2, 0, {5, 5, 5, 5}));
+  receive();
+  assert_pixel(0, 4, 4, 4, 4);
+}
+
+void test_stream_times_out() {
+  send_packet(udp::DDP_PORT, ddp_packet(1, 0, {1, 2, 3}));
+  receive();
+  TEST_ASSERT_EQUAL(REALTIME_DDP, led::realtime_source);
+
+  mock_advance_ms(config->realtime_timeout + 1);
+  receive();
+  TEST_ASSERT_EQUAL(REALTIME_NONE, led::realtime_source);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_ddp);
+  RUN_TEST(test_e131);
+  RUN_TEST(test_artnet);
+  RUN_TEST(test_e131_late_packet_dropped);
+  RUN_TEST(test_e131_terminate_needs_active_sender);
+  RUN_TEST(test_e131_priority_between_senders);
+  RUN_TEST(test_stream_times_out);
+  return UNITY_END();
+}